@@ -1 +1,5 @@
-clang++ -std=c++14 -O0 -g -Wall -Wextra -Wno-backslash-newline-escape ductus.cpp
+FLAGS="-std=c++14 -Wall -Wextra -Wno-backslash-newline-escape -pthread"
+clang++ $FLAGS -O0 -g ductus.cpp -o ductus
+clang++ $FLAGS -O2 -DNDEBUG -march=native ductus.cpp -o ductus_release
+clang++ $FLAGS -Wno-unused-function -O2 -DNDEBUG -march=native ductus_bench.cpp -o ductus_bench
+clang++ $FLAGS -Wno-unused-function -O2 -DNDEBUG -DDUCTUS_NO_MAIN -fPIC -shared ductus.cpp -o libductus.so
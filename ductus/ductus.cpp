@@ -2,12 +2,30 @@
 
 #include <assert.h>
 #include <malloc.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include <setjmp.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ductus.h"
 
 #define TokenList                 \
     TokenEntry(INVALID)           \
@@ -25,12 +43,7 @@
 	TokenEntry(SLASH)			  \
                                   \
     TokenEntry(POUND)             \
-    TokenEntry(POUND_FOR)         \
-    TokenEntry(POUND_ENDFOR)      \
-    TokenEntry(POUND_LINE)        \
-    TokenEntry(POUND_LINE_CLIP)   \
-	TokenEntry(POUND_WORD)		  \
-    TokenEntry(POUND_REPLACE)     \
+    ProcedureList                 \
                                   \
     TokenEntry(STRING)            \
     TokenEntry(COMMENT)           \
@@ -40,28 +53,54 @@
 	TokenEntry(END_OF_BUFFER)	  \
 
 
-#if 0
-#define ProcedureList             \
-    ProcedureEntry(r, "target replacewith", "Replace", "Replaces the target string with the replace string.  Searches all text within the current scope")        \
-    ProcedureEntry(rw, "target replace_with", "Replace Word", "Replaces the target word with the replace word.  Searches all text within the current scope")    \
-    ProcedureEntry(d, "target", "Delete", "Removes the target text from all text within the current scope")                                                        \
-    ProcedureEntry(dw, "target", "Delete Word", "Deletes the current word from all the text within the current scope")                                            \
-    ProcedureEntry(ptr, "target", "To Pointer", "Converts the targets syntax to treat it as if it were a pointer")                                                \
-    ProcedureEntry(val, "target", "To Value", "Converts the targets syntax to treat it as if it were a value")
-#endif
+//parse_expansion_program counts on #fl through #r staying first.  A NULL
+//handler means the directive does nothing by itself
+#define ProcedureList \
+    ProcedureEntry(FOR, "fl", 0, run_for_lines_procedure, "", "For Lines", "Starts a block of lines that #efl repeats its program over") \
+    ProcedureEntry(ENDFOR, "efl", 0, NULL, "(program)", "End For Lines", "Ends the #fl block and pastes the program once for each of its lines") \
+    ProcedureEntry(LINE, "l", 0, NULL, "", "Line", "Pastes the current line inside an #efl program") \
+    ProcedureEntry(LINE_CLIP, "lc", 0, NULL, "(x, y)", "Line Clip", "Pastes the current line with x chars removed from the front and y from the back") \
+    ProcedureEntry(WORD, "w", 0, NULL, "(i)", "Word", "Pastes the identifier at index i of the current line") \
+    ProcedureEntry(REPLACE, "r", ProcedureFlag_IDENTIFIER | ProcedureFlag_REPLACEMENT, run_identifier_procedure, "target replacewith", "Replace", "Replaces the target string with the replace string.  Searches all text within the current scope") \
+    ProcedureEntry(REPLACE_WORD, "rw", ProcedureFlag_IDENTIFIER | ProcedureFlag_REPLACEMENT, run_identifier_procedure, "target replace_with", "Replace Word", "Replaces the target word with the replace word.  Searches all text within the current scope") \
+    ProcedureEntry(DELETE, "d", ProcedureFlag_IDENTIFIER | ProcedureFlag_WHOLE_NAME, run_identifier_procedure, "target", "Delete", "Removes the target text from all text within the current scope") \
+    ProcedureEntry(DELETE_WORD, "dw", ProcedureFlag_IDENTIFIER | ProcedureFlag_WHOLE_NAME, run_identifier_procedure, "target", "Delete Word", "Deletes the current word from all the text within the current scope") \
+    ProcedureEntry(POINTER, "ptr", ProcedureFlag_IDENTIFIER | ProcedureFlag_WHOLE_NAME, run_identifier_procedure, "target", "To Pointer", "Converts the targets syntax to treat it as if it were a pointer") \
+    ProcedureEntry(VALUE, "val", ProcedureFlag_IDENTIFIER | ProcedureFlag_WHOLE_NAME, run_identifier_procedure, "target", "To Value", "Converts the targets syntax to treat it as if it were a value") \
+
+typedef enum
+{
+    ProcedureFlag_IDENTIFIER = 1 << 0,  //Collects a rule over the identifiers of its scope
+    ProcedureFlag_REPLACEMENT = 1 << 1, //Takes a second identifier to put in
+    ProcedureFlag_WHOLE_NAME = 1 << 2,  //Only counts when no identifier carries on after the name
+} ProcedureFlag;
+
+typedef enum
+{
+#define ProcedureEntry(token, ...) ProcedureIndex_##token,
+    ProcedureList
+#undef ProcedureEntry
+    PROCEDURE_COUNT
+} ProcedureIndex;
 
 typedef enum
 {
 #define TokenEntry(name) TokenType_##name,
+#define ProcedureEntry(token, ...) TokenType_POUND_##token,
     TokenList
     TokenType_COUNT
+#undef ProcedureEntry
 #undef TokenEntry
 } TokenType;
 
+#define FIRST_PROCEDURE_TOKEN (TokenType_POUND + 1)
+
 static const char *TOKEN_STRINGS[] =
 {
 #define TokenEntry(name) #name,
+#define ProcedureEntry(token, ...) "POUND_" #token,
     TokenList
+#undef ProcedureEntry
 #undef TokenEntry
 };
 
@@ -79,34 +118,345 @@ typedef struct {
     uint32_t line_offset;
     bool is_first_token_in_line;
     Token token;
+    const char *filename;
+    jmp_buf *error_jump;
+    bool is_streaming;
+    bool is_partial;
+    const char *top_level_boundary;
+    size_t token_count;
 } Lexer;
 
+typedef struct {
+    const char *text;
+    size_t length;
+} EditPiece;
+
+//Blocks are chained so pointers stay put when the arena grows
 typedef struct
-EditResultStruct {
-    char *buffer;
-    size_t size;
-    struct EditResultStruct *next;
-} EditResult;
+MemoryBlockStruct {
+    size_t used;
+    size_t capacity;
+    struct MemoryBlockStruct *next;
+} MemoryBlock;
+
+typedef struct {
+    MemoryBlock *first_block;
+    MemoryBlock *current_block;
+    size_t used;
+    size_t peak_used;         //Since the last reset
+} MemoryArena;
+
+#define MEMORY_BLOCK_SIZE (256 * 1024)
+#define MEMORY_ALIGNMENT 16
+#define MEMORY_BLOCK_HEADER_SIZE ((sizeof(MemoryBlock) + MEMORY_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALIGNMENT - 1))
+
+static inline size_t align_memory_size(size_t size)
+{
+    return (size + MEMORY_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALIGNMENT - 1);
+}
+
+static inline char *get_block_memory(MemoryBlock *block)
+{
+    return (char *)block + MEMORY_BLOCK_HEADER_SIZE;
+}
+
+static void *arena_allocate(MemoryArena *arena, size_t size)
+{
+    size = align_memory_size(size);
+    MemoryBlock *block = arena->current_block;
+    while (block != NULL && block->used + size > block->capacity)
+    {
+        block = block->next;
+        if (block != NULL) block->used = 0;
+    }
+
+    if (block == NULL)
+    {
+        size_t capacity = size > MEMORY_BLOCK_SIZE ? size : MEMORY_BLOCK_SIZE;
+        block = (MemoryBlock *)malloc(MEMORY_BLOCK_HEADER_SIZE + capacity);
+        block->used = 0;
+        block->capacity = capacity;
+        block->next = NULL;
+        if (arena->current_block == NULL)
+        {
+            arena->first_block = block;
+        }
+        else
+        {
+            block->next = arena->current_block->next;
+            arena->current_block->next = block;
+        }
+    }
+
+    arena->current_block = block;
+    void *result = get_block_memory(block) + block->used;
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->peak_used) arena->peak_used = arena->used;
+    return result;
+}
+
+static void *arena_resize(MemoryArena *arena, void *data, size_t old_size, size_t new_size)
+{
+    old_size = align_memory_size(old_size);
+    new_size = align_memory_size(new_size);
+    MemoryBlock *block = arena->current_block;
+    if (data != NULL && block != NULL &&
+        (char *)data + old_size == get_block_memory(block) + block->used &&
+        block->used - old_size + new_size <= block->capacity)
+    {
+        block->used = block->used - old_size + new_size;
+        arena->used = arena->used - old_size + new_size;
+        if (arena->used > arena->peak_used) arena->peak_used = arena->used;
+        return data;
+    }
+
+    void *result = arena_allocate(arena, new_size);
+    if (data != NULL) memcpy(result, data, old_size < new_size ? old_size : new_size);
+    return result;
+}
+
+static void reset_arena(MemoryArena *arena)
+{
+    arena->current_block = arena->first_block;
+    if (arena->current_block != NULL)
+    {
+        arena->current_block->used = 0;
+    }
+    arena->used = 0;
+    arena->peak_used = 0;
+}
+
+//Like reset_arena but keeps the peak
+static void rewind_arena(MemoryArena *arena)
+{
+    size_t peak_used = arena->peak_used;
+    reset_arena(arena);
+    arena->peak_used = peak_used;
+}
+
+static void free_arena(MemoryArena *arena)
+{
+    MemoryBlock *block = arena->first_block;
+    while (block != NULL)
+    {
+        MemoryBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof(MemoryArena));
+}
+
+static void *reserve_array_element(MemoryArena *arena, void *data, size_t count,
+    size_t *capacity, size_t element_size)
+{
+    if (count == *capacity)
+    {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64;
+        if (arena != NULL)
+        {
+            data = arena_resize(arena, data, element_size * *capacity, element_size * new_capacity);
+        }
+        else
+        {
+            data = realloc(data, element_size * new_capacity);
+        }
+        *capacity = new_capacity;
+    }
+    return data;
+}
+
+#define push_array_element(arena, array, count, capacity) \
+    (array = (decltype(array))reserve_array_element(arena, array, count, &capacity, sizeof(*array)), \
+     &array[count++])
+
+typedef struct {
+    const char *begin;
+    const char *end;
+    const char *text;
+    size_t length;
+} SourceEdit;
+
+typedef enum
+{
+    ReplaceKind_TEXT,         //#r, #d
+    ReplaceKind_WORD,         //#rw, #dw
+    ReplaceKind_TO_POINTER,   //#ptr
+    ReplaceKind_TO_VALUE,     //#val
+} ReplaceKind;
+
+typedef struct {
+    const char *target;
+    size_t target_length;
+    const char *replacement;
+    size_t replacement_length;
+    uint32_t scope_index;
+    ReplaceKind kind;
+} ReplaceRule;
+
+typedef struct {
+    const char *begin;
+    const char *end;
+} ReplaceScope;
+
+typedef struct {
+    uint32_t offset;          //From the start of the occurrence
+    uint32_t length;
+    uint32_t rule_index;
+    uint32_t occurrence;
+    uint32_t priority;        //Lower wins when two rules hit the same text
+} ReplaceMatch;
+
+typedef struct {
+    int32_t *transitions;
+    int32_t *rule_index;
+    int32_t *output_link;
+    size_t state_count;
+} ReplaceAutomaton;
+
+typedef struct {
+    ReplaceAutomaton automaton;
+    uint32_t *first_state_rule;
+    uint32_t *state_rules;
+    size_t rule_count;
+} ReplaceRuleSet;
+
+typedef struct {
+    MemoryArena arena;
+    ReplaceRule *rules;
+    size_t rule_count;
+    size_t rule_capacity;
+    ReplaceRuleSet rule_set;
+    uint64_t hash;                 //Of the script text
+} ScriptPlan;
+
+#define SCOPE_NONE 0xFFFFFFFFu
+
+typedef struct {
+    const char *begin;        //Just past the '{'
+    const char *end;          //At the matching '}', the end of the buffer when unclosed
+    uint32_t parent;
+    uint32_t depth;
+    int replace_scope_index;
+} Scope;
+
+#define StatsPhaseList                \
+    StatsPhaseEntry(READ, read)       \
+    StatsPhaseEntry(LEX, lex)         \
+    StatsPhaseEntry(SCOPES, scopes)   \
+    StatsPhaseEntry(EXPAND, expand)   \
+    StatsPhaseEntry(REPLACE, replace) \
+    StatsPhaseEntry(WRITE, write)
+
+typedef enum
+{
+#define StatsPhaseEntry(name, label) StatsPhase_##name,
+    StatsPhaseList
+    StatsPhase_COUNT
+#undef StatsPhaseEntry
+} StatsPhase;
+
+static const char *STATS_PHASE_NAMES[] =
+{
+#define StatsPhaseEntry(name, label) #label,
+    StatsPhaseList
+#undef StatsPhaseEntry
+};
 
+typedef struct {
+    double phase_seconds[StatsPhase_COUNT];
+    size_t input_bytes;
+    size_t output_bytes;
+    size_t token_count;       //Tokens actually lexed, text between directives is skipped
+    size_t directive_count;
+    size_t piece_count;
+    size_t arena_peak;
+} RunStats;
+
+static double get_seconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    MemoryArena arena;
+    MemoryArena scratch;           //What a #fl works with, emptied after each one
+    RunStats stats;
+
+    Scope *scopes;
+    size_t scope_count;
+    size_t scope_capacity;
+
+    EditPiece *pieces;
+    size_t piece_count;
+    size_t piece_capacity;
 
-static EditResult *g_root_edit_result = NULL;
-static EditResult *g_last_edit_result = NULL;
-static const char *buffer_read_pos;
-static inline void push_edit_result(const char *buffer, size_t size)
+    SourceEdit *source_edits;
+    size_t source_edit_count;
+    size_t source_edit_capacity;
+
+    ReplaceRule *replace_rules;
+    size_t replace_rule_count;
+    size_t replace_rule_capacity;
+
+    ReplaceScope *replace_scopes;
+    size_t replace_scope_count;
+    size_t replace_scope_capacity;
+
+    ReplaceMatch *replace_matches;
+    size_t replace_match_count;
+    size_t replace_match_capacity;
+
+    const ReplaceRuleSet *plan_rule_set;
+} EditState;
+
+static inline void push_edit_piece(EditState *edit, const char *text, size_t length)
 {
-    EditResult *result = (EditResult*)malloc(sizeof(EditResult) + size);
-    result->buffer = (char *)(result + 1);
-    memcpy(result->buffer, buffer, size);
-    result->size = size;
-    result->next = NULL;
+    if (length == 0) return;
 
-    if (g_root_edit_result == NULL) {
-        g_root_edit_result = result;
-        g_last_edit_result = result;
-    } else {
-        g_last_edit_result->next = result;
-        g_last_edit_result = result;
+    if (edit->piece_count > 0)
+    {
+        EditPiece *last = &edit->pieces[edit->piece_count - 1];
+        if (last->text + last->length == text)
+        {
+            last->length += length;
+            return;
+        }
     }
+
+    EditPiece *piece = push_array_element(&edit->arena, edit->pieces, edit->piece_count, edit->piece_capacity);
+    piece->text = text;
+    piece->length = length;
+}
+
+static void free_edit_state(EditState *edit)
+{
+    free_arena(&edit->arena);
+    free_arena(&edit->scratch);
+    memset(edit, 0, sizeof(EditState));
+}
+
+static void reset_edit_state(EditState *edit)
+{
+    reset_arena(&edit->arena);
+    reset_arena(&edit->scratch);
+    MemoryArena arena = edit->arena;
+    MemoryArena scratch = edit->scratch;
+    memset(edit, 0, sizeof(EditState));
+    edit->arena = arena;
+    edit->scratch = scratch;
+}
+
+static inline void push_source_edit(EditState *edit, const char *begin, const char *end,
+    const char *text, size_t length)
+{
+    SourceEdit *source_edit = push_array_element(&edit->arena, edit->source_edits, edit->source_edit_count, edit->source_edit_capacity);
+    source_edit->begin = begin;
+    source_edit->end = end;
+    source_edit->text = text;
+    source_edit->length = length;
 }
 
 static inline bool is_alpha(char c)
@@ -156,14 +506,311 @@ static inline int strings_match(const char* string_a, size_t length_a, const cha
     return 1;
 }
 
+//=========================================================
+// Procedure registry
+//=========================================================
+
+
+#define PROCEDURE_HASH_BITS 5
+#define PROCEDURE_HASH_SIZE (1 << PROCEDURE_HASH_BITS)
+#define PROCEDURE_HASH_MAX_SEED 0xFFFF
+
+static constexpr const char *PROCEDURE_NAMES[] =
+{
+#define ProcedureEntry(token, name, ...) name,
+    ProcedureList
+#undef ProcedureEntry
+};
+
+static constexpr uint32_t PROCEDURE_NAME_LENGTHS[] =
+{
+#define ProcedureEntry(token, name, ...) sizeof(name) - 1,
+    ProcedureList
+#undef ProcedureEntry
+};
+
+static const uint32_t PROCEDURE_FLAGS[] =
+{
+#define ProcedureEntry(token, name, flags, ...) flags,
+    ProcedureList
+#undef ProcedureEntry
+};
+
+typedef struct {
+    uint32_t seed;
+    uint8_t slots[PROCEDURE_HASH_SIZE];    //Index of the procedure + 1, 0 when empty
+} ProcedureHashTable;
+
+static constexpr uint32_t hash_procedure_name(const char *name, uint32_t length, uint32_t seed)
+{
+    uint32_t hash = seed;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (uint8_t)name[i]) * 0x9E3779B1;
+    }
+    return hash >> (32 - PROCEDURE_HASH_BITS);
+}
+
+static constexpr ProcedureHashTable build_procedure_hash_table()
+{
+    ProcedureHashTable result = {};
+    for (uint32_t seed = 1; seed <= PROCEDURE_HASH_MAX_SEED; seed++)
+    {
+        for (uint32_t i = 0; i < PROCEDURE_HASH_SIZE; i++) result.slots[i] = 0;
+        bool is_perfect = true;
+        for (uint32_t i = 0; i < PROCEDURE_COUNT && is_perfect; i++)
+        {
+            uint32_t slot = hash_procedure_name(PROCEDURE_NAMES[i], PROCEDURE_NAME_LENGTHS[i], seed);
+            is_perfect = result.slots[slot] == 0;
+            result.slots[slot] = (uint8_t)(i + 1);
+        }
+        if (is_perfect)
+        {
+            result.seed = seed;
+            return result;
+        }
+    }
+    return result;
+}
+
+static constexpr uint32_t get_procedure_name_max_length()
+{
+    uint32_t result = 0;
+    for (uint32_t i = 0; i < PROCEDURE_COUNT; i++)
+    {
+        if (PROCEDURE_NAME_LENGTHS[i] > result) result = PROCEDURE_NAME_LENGTHS[i];
+    }
+    return result;
+}
+
+static constexpr ProcedureHashTable PROCEDURE_HASH_TABLE = build_procedure_hash_table();
+static constexpr uint32_t PROCEDURE_NAME_MAX_LENGTH = get_procedure_name_max_length();
+static_assert(PROCEDURE_HASH_TABLE.seed != 0, "No perfect hash for the procedure names, raise PROCEDURE_HASH_BITS");
+
+static inline int find_procedure(const char *name, uint32_t length)
+{
+    uint32_t slot = PROCEDURE_HASH_TABLE.slots[hash_procedure_name(name, length, PROCEDURE_HASH_TABLE.seed)];
+    if (slot == 0) return -1;
+    int index = (int)slot - 1;
+    if (PROCEDURE_NAME_LENGTHS[index] != length || memcmp(PROCEDURE_NAMES[index], name, length) != 0) return -1;
+    return index;
+}
+
+//#d would swallow the start of every #define, so a WHOLE_NAME procedure
+//only counts when no identifier carries on right after it
+static inline TokenType lex_procedure_name(const char *name, const char *end, const char **name_end)
+{
+    uint32_t available = 0;
+    while (available < PROCEDURE_NAME_MAX_LENGTH && name + available < end &&
+        (is_alpha(name[available]) || is_number(name[available]) || name[available] == '_'))
+    {
+        available++;
+    }
+
+    for (uint32_t length = available; length > 0; length--)
+    {
+        int index = find_procedure(name, length);
+        if (index < 0) continue;
+
+        const char *after = name + length;
+        if ((PROCEDURE_FLAGS[index] & ProcedureFlag_WHOLE_NAME) && after < end &&
+            (is_alpha(*after) || is_number(*after) || *after == '_'))
+        {
+            break;
+        }
+        *name_end = after;
+        return (TokenType)(FIRST_PROCEDURE_TOKEN + index);
+    }
+
+    *name_end = name;
+    return TokenType_POUND;
+}
+
+static inline uint32_t get_procedure_flags(TokenType type)
+{
+    if (type < FIRST_PROCEDURE_TOKEN || type >= FIRST_PROCEDURE_TOKEN + PROCEDURE_COUNT) return 0;
+    return PROCEDURE_FLAGS[type - FIRST_PROCEDURE_TOKEN];
+}
+
+//=========================================================
+// Vectorized scanning
+//=========================================================
+
+//These never load past end, which is where the null terminator lives
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 32
+typedef __m256i SimdBytes;
+static inline SimdBytes simd_load(const char *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline SimdBytes simd_set(char c) { return _mm256_set1_epi8(c); }
+static inline SimdBytes simd_eq(SimdBytes a, SimdBytes b) { return _mm256_cmpeq_epi8(a, b); }
+static inline SimdBytes simd_gt(SimdBytes a, SimdBytes b) { return _mm256_cmpgt_epi8(a, b); }
+static inline SimdBytes simd_or(SimdBytes a, SimdBytes b) { return _mm256_or_si256(a, b); }
+static inline SimdBytes simd_and(SimdBytes a, SimdBytes b) { return _mm256_and_si256(a, b); }
+static inline uint32_t simd_mask(SimdBytes a) { return (uint32_t)_mm256_movemask_epi8(a); }
+#define SIMD_FULL_MASK 0xFFFFFFFFu
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_WIDTH 16
+typedef __m128i SimdBytes;
+static inline SimdBytes simd_load(const char *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline SimdBytes simd_set(char c) { return _mm_set1_epi8(c); }
+static inline SimdBytes simd_eq(SimdBytes a, SimdBytes b) { return _mm_cmpeq_epi8(a, b); }
+static inline SimdBytes simd_gt(SimdBytes a, SimdBytes b) { return _mm_cmpgt_epi8(a, b); }
+static inline SimdBytes simd_or(SimdBytes a, SimdBytes b) { return _mm_or_si128(a, b); }
+static inline SimdBytes simd_and(SimdBytes a, SimdBytes b) { return _mm_and_si128(a, b); }
+static inline uint32_t simd_mask(SimdBytes a) { return (uint32_t)_mm_movemask_epi8(a); }
+#define SIMD_FULL_MASK 0xFFFFu
+#endif
+
+#ifdef SIMD_WIDTH
+//Signed compares are fine here, every range we care about is ASCII so
+//bytes >= 0x80 come out negative and fall outside of it
+static inline SimdBytes simd_in_range(SimdBytes v, char low, char high)
+{
+    return simd_and(simd_gt(v, simd_set(low - 1)), simd_gt(simd_set(high + 1), v));
+}
+
+static inline uint32_t simd_identifier_mask(SimdBytes v)
+{
+    SimdBytes letters = simd_in_range(simd_or(v, simd_set(0x20)), 'a', 'z');
+    SimdBytes digits = simd_in_range(v, '0', '9');
+    SimdBytes underscore = simd_eq(v, simd_set('_'));
+    return simd_mask(simd_or(simd_or(letters, digits), underscore));
+}
+
+static inline uint32_t simd_whitespace_mask(SimdBytes v)
+{
+    return simd_mask(simd_or(simd_eq(v, simd_set(' ')), simd_eq(v, simd_set('\t'))));
+}
+
+static inline uint32_t simd_number_mask(SimdBytes v)
+{
+    return simd_mask(simd_or(simd_in_range(v, '0', '9'), simd_eq(v, simd_set('.'))));
+}
+#endif
+
+static inline const char *skip_identifier_chars(const char *cursor, const char *end)
+{
+#ifdef SIMD_WIDTH
+    while (end - cursor >= SIMD_WIDTH)
+    {
+        uint32_t mask = ~simd_identifier_mask(simd_load(cursor)) & SIMD_FULL_MASK;
+        if (mask != 0) return cursor + __builtin_ctz(mask);
+        cursor += SIMD_WIDTH;
+    }
+#endif
+    while (cursor < end && (is_alpha(*cursor) || is_number(*cursor) || *cursor == '_')) cursor++;
+    return cursor;
+}
+
+static inline const char *skip_whitespace_chars(const char *cursor, const char *end)
+{
+#ifdef SIMD_WIDTH
+    while (end - cursor >= SIMD_WIDTH)
+    {
+        uint32_t mask = ~simd_whitespace_mask(simd_load(cursor)) & SIMD_FULL_MASK;
+        if (mask != 0) return cursor + __builtin_ctz(mask);
+        cursor += SIMD_WIDTH;
+    }
+#endif
+    while (cursor < end && (*cursor == ' ' || *cursor == '\t')) cursor++;
+    return cursor;
+}
+
+static inline const char *skip_number_chars(const char *cursor, const char *end)
+{
+#ifdef SIMD_WIDTH
+    while (end - cursor >= SIMD_WIDTH)
+    {
+        uint32_t mask = ~simd_number_mask(simd_load(cursor)) & SIMD_FULL_MASK;
+        if (mask != 0) return cursor + __builtin_ctz(mask);
+        cursor += SIMD_WIDTH;
+    }
+#endif
+    while (cursor < end && (is_number(*cursor) || *cursor == '.')) cursor++;
+    return cursor;
+}
+
+static inline const char *find_identifier_char(const char *cursor, const char *end)
+{
+#ifdef SIMD_WIDTH
+    while (end - cursor >= SIMD_WIDTH)
+    {
+        uint32_t mask = simd_identifier_mask(simd_load(cursor));
+        if (mask != 0) return cursor + __builtin_ctz(mask);
+        cursor += SIMD_WIDTH;
+    }
+#endif
+    while (cursor < end && !(is_alpha(*cursor) || is_number(*cursor) || *cursor == '_')) cursor++;
+    return cursor;
+}
+
+static inline const char *find_line_break(const char *cursor, const char *end)
+{
+#ifdef SIMD_WIDTH
+    while (end - cursor >= SIMD_WIDTH)
+    {
+        SimdBytes v = simd_load(cursor);
+        uint32_t mask = simd_mask(simd_or(simd_eq(v, simd_set('\n')), simd_eq(v, simd_set('\r'))));
+        if (mask != 0) return cursor + __builtin_ctz(mask);
+        cursor += SIMD_WIDTH;
+    }
+#endif
+    while (cursor < end && *cursor != '\n' && *cursor != '\r') cursor++;
+    return cursor;
+}
+
+static inline size_t count_line_breaks(const char *cursor, const char *end)
+{
+    size_t result = 0;
+#ifdef SIMD_WIDTH
+    while (end - cursor >= SIMD_WIDTH)
+    {
+        SimdBytes v = simd_load(cursor);
+        uint32_t lf_mask = simd_mask(simd_eq(v, simd_set('\n')));
+        uint32_t cr_mask = simd_mask(simd_eq(v, simd_set('\r')));
+        bool is_lf_next = cursor + SIMD_WIDTH < end && cursor[SIMD_WIDTH] == '\n';
+        uint32_t next_lf_mask = (lf_mask >> 1) | ((uint32_t)is_lf_next << (SIMD_WIDTH - 1));
+        result += __builtin_popcount(lf_mask | (cr_mask & ~next_lf_mask));
+        cursor += SIMD_WIDTH;
+    }
+#endif
+    for (; cursor < end; cursor++)
+    {
+        if (*cursor == '\n' || (*cursor == '\r' && (cursor + 1 == end || cursor[1] != '\n'))) result++;
+    }
+    return result;
+}
+
+static inline const char *find_scope_char(const char *cursor, const char *end)
+{
+#ifdef SIMD_WIDTH
+    while (end - cursor >= SIMD_WIDTH)
+    {
+        SimdBytes v = simd_load(cursor);
+        uint32_t mask = simd_mask(simd_or(
+            simd_or(simd_eq(v, simd_set('{')), simd_eq(v, simd_set('}'))),
+            simd_or(simd_or(simd_eq(v, simd_set('"')), simd_eq(v, simd_set('\''))),
+                simd_or(simd_eq(v, simd_set('/')), simd_eq(v, simd_set('#'))))));
+        if (mask != 0) return cursor + __builtin_ctz(mask);
+        cursor += SIMD_WIDTH;
+    }
+#endif
+    while (cursor < end && *cursor != '{' && *cursor != '}' && *cursor != '"' &&
+        *cursor != '\'' && *cursor != '/' && *cursor != '#') cursor++;
+    return cursor;
+}
+
 static inline int64_t to_int(Token token)
 {
 	assert(token.type == TokenType_INTEGER);
     int64_t result = 0;
-    for (int i = token.length - 1; i >= 0; i--)
+    for (uint32_t i = 0; i < token.length; i++)
     {
-        uint8_t digit_value = token.text[i] - '0';
-        result += digit_value + (i * 10);
+        if (!is_number(token.text[i])) break;
+        result = (result * 10) + (token.text[i] - '0');
     }
     return result;
 }
@@ -194,6 +841,7 @@ static void increment_past_whitespace(Lexer *lex)
 }
 static inline void lex_next_token_and_whitespace(Lexer *lex)
 {
+    const char *lex_end = lex->buffer + lex->buffer_size;
     lex->token.text = lex->current;
 
 	if (*lex->current == '\r') 
@@ -223,20 +871,13 @@ static inline void lex_next_token_and_whitespace(Lexer *lex)
 
 	else if (*lex->current == ' ' || *lex->current == '\t')
 	{
-		lex->current++;
-		while (*lex->current == ' ' || *lex->current == '\t')
-		{
-			lex->current++;
-		}
+		lex->current = skip_whitespace_chars(lex->current + 1, lex_end);
 		lex->token.type = TokenType_WHITESPACE;
 	}
 
     else if (is_alpha(*lex->current) || *lex->current == '_')
     {
-        while (is_alpha(*lex->current) || is_number(*lex->current) || *lex->current == '_')
-        {
-            lex->current += 1;
-        }
+        lex->current = skip_identifier_chars(lex->current + 1, lex_end);
         lex->token.type = TokenType_IDENTIFIER;
     }
 
@@ -251,22 +892,11 @@ static inline void lex_next_token_and_whitespace(Lexer *lex)
     lex->current += static_strlen(token_string); \
 }
 
-#define check_token_and_subtokens(token_type, token_string, subtoken_macro) else if (token_match(token_string)) { \
-    lex->current += static_strlen(token_string); \
-    if (0) {} subtoken_macro \
-    else { \
-        lex->token.type = token_type; \
-    } \
-}
-
     else if (is_number(*lex->current))
     {
         lex->token.text = lex->current;
         bool dot_was_parsed = false;
-        while(is_number(*lex->current) || (!dot_was_parsed && *lex->current == '.'))
-        {
-            lex->current++;
-        }
+        lex->current = skip_number_chars(lex->current + 1, lex_end);
         lex->token.type = dot_was_parsed ? TokenType_FLOAT : TokenType_INTEGER;
     }
 
@@ -291,13 +921,10 @@ static inline void lex_next_token_and_whitespace(Lexer *lex)
     check_token(TokenType_COMMA, ",")
     check_token(TokenType_QUOTE, "\"")
 
-    check_token_and_subtokens(TokenType_POUND, "#",
-        check_token(TokenType_POUND_REPLACE, "r")
-        check_token_and_subtokens(TokenType_POUND_LINE, "l",
-            check_token(TokenType_POUND_LINE_CLIP, "c"))
-        check_token(TokenType_POUND_FOR, "fl")
-        check_token(TokenType_POUND_ENDFOR, "efl")
-		check_token(TokenType_POUND_WORD, "w"))
+    else if (*lex->current == '#')
+    {
+        lex->token.type = lex_procedure_name(lex->current + 1, lex_end, &lex->current);
+    }
 
     check_token(TokenType_END_OF_BUFFER, "\0")
 
@@ -311,6 +938,7 @@ static inline void lex_next_token_and_whitespace(Lexer *lex)
 
 	lex->token.length = lex->current - lex->token.text;
 	lex->line_offset += lex->token.length;
+	lex->token_count++;
 }
 
 static inline void lex_next_token(Lexer *lex)
@@ -329,16 +957,48 @@ static inline void lex_next_token(Lexer *lex)
 static inline
 void report_error_internal(Lexer *lex)
 {
-    printf("ERROR[%d:%d] ", lex->line_number + 1, lex->line_offset + 1);
+    if (lex->filename != NULL)
+    {
+        fprintf(stderr, "%s ", lex->filename);
+    }
+    fprintf(stderr, "ERROR[%d:%d] ", lex->line_number + 1, lex->line_offset + 1);
+}
+
+//A streamed buffer may end before the input does, the caller comes back
+//with more of it
+#define LEXER_JUMP_ERROR 1
+#define LEXER_JUMP_NEED_MORE_INPUT 2
+
+static inline
+void abort_lexer(Lexer *lex)
+{
+    if (lex->error_jump != NULL)
+    {
+        longjmp(*lex->error_jump, LEXER_JUMP_ERROR);
+    }
+    abort();
+}
+
+static inline
+void request_more_input(Lexer *lex)
+{
+    if (lex->is_partial && lex->error_jump != NULL)
+    {
+        longjmp(*lex->error_jump, LEXER_JUMP_NEED_MORE_INPUT);
+    }
 }
 
-#define report_error(lex_ptr, ...) report_error_internal(lex_ptr); printf(__VA_ARGS__); printf("\n")
-#define report_error_and_exit(lex_ptr, ...) { report_error_internal(lex_ptr); printf(__VA_ARGS__); printf("\n"); abort(); }
+#define report_error(lex_ptr, ...) flockfile(stderr); report_error_internal(lex_ptr); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); funlockfile(stderr)
+#define report_error_and_exit(lex_ptr, ...) { report_error(lex_ptr, __VA_ARGS__); abort_lexer(lex_ptr); }
 
 static inline
 void lex_and_expect_token(TokenType type, Lexer *lex)
 {
     lex_next_token(lex);
+    if (lex->token.type == TokenType_END_OF_BUFFER)
+    {
+        request_more_input(lex);
+    }
     if (lex->token.type != type)
     {
         report_error(lex, "Expected Token '%s', instead parsed Token(%s)",
@@ -352,8 +1012,9 @@ void lex_and_require_valid_token(Lexer *lex)
     lex_next_token(lex);
     if (lex->token.type == TokenType_END_OF_BUFFER)
     {
+        request_more_input(lex);
         report_error(lex, "Reached end of file unexpectedly");
-        abort();
+        abort_lexer(lex);
     }
 }
 
@@ -368,635 +1029,5512 @@ void ensure_token(Lexer *lex, TokenType type)
 }
 
 static inline
-const char *seek_to_next_line(const char *cursor)
+const char *seek_to_next_line(const char *cursor, const char *end)
 {
-    while (!is_end_of_line(cursor))
+    while (cursor < end)
     {
+        cursor = find_line_break(cursor, end);
+        if (cursor == end) break;
+        if (is_end_of_line(cursor)) return cursor + 1;
         cursor++;
     }
-    cursor++;
-    return cursor;
+    return end;
+}
+
+static inline bool is_identifier_directive(TokenType type)
+{
+    return (get_procedure_flags(type) & ProcedureFlag_IDENTIFIER) != 0;
 }
 
-static inline void parse_block(Lexer *lex, const char *current_block)
+static inline bool is_directive_char(char c)
 {
-    while (lex->token.type != TokenType_END_OF_BUFFER && lex->token.type != TokenType_BRACE_CLOSE)
+    return c == '#' || c == 0;
+}
+
+//Never goes past end, which for a chunk of a split file is not a null
+static void lex_skip_to_directive(Lexer *lex)
+{
+    const char *end = lex->buffer + lex->buffer_size;
+    const char *cursor = lex->current;
+    const char *line_start = NULL;
+    uint32_t line_count = 0;
+
+#ifdef SIMD_WIDTH
+    while (end - cursor >= SIMD_WIDTH)
     {
-        lex_next_token(lex);
+        SimdBytes v = simd_load(cursor);
+        uint32_t stop_mask = simd_mask(simd_or(simd_eq(v, simd_set('#')), simd_eq(v, simd_set(0))));
+
+        //cursor[SIMD_WIDTH] is at most the terminator so peeking it is fine
+        uint32_t lf_mask = simd_mask(simd_eq(v, simd_set('\n')));
+        uint32_t cr_mask = simd_mask(simd_eq(v, simd_set('\r')));
+        uint32_t next_lf_mask = (lf_mask >> 1) | ((uint32_t)(cursor[SIMD_WIDTH] == '\n') << (SIMD_WIDTH - 1));
+        uint32_t newline_mask = lf_mask | (cr_mask & ~next_lf_mask);
 
-        if (lex->token.type == TokenType_BRACE_OPEN)
+        if (stop_mask != 0)
         {
-            parse_block(lex, lex->token.text + 1);
-            if (lex->token.type == TokenType_BRACE_CLOSE)
-            {
-                lex_next_token(lex);
-            }
+            uint32_t stop_index = __builtin_ctz(stop_mask);
+            newline_mask &= (1u << stop_index) - 1;
         }
 
-        if (lex->token.type == TokenType_POUND_FOR)
+        if (newline_mask != 0)
         {
-            size_t edit_offset = lex->token.text - buffer_read_pos;
-            push_edit_result(buffer_read_pos, edit_offset);
-            buffer_read_pos = lex->token.text + lex->token.length;
-            buffer_read_pos = seek_to_next_line(buffer_read_pos);
-            lex_and_require_valid_token(lex);
+            line_count += __builtin_popcount(newline_mask);
+            line_start = cursor + (31 - __builtin_clz(newline_mask)) + 1;
+        }
 
-            size_t line_begin = lex->line_number;
+        if (stop_mask != 0)
+        {
+            cursor += __builtin_ctz(stop_mask);
+            break;
+        }
+        cursor += SIMD_WIDTH;
+    }
+#endif
 
-			Token tokens[4096];
-			size_t token_count = 0;
-            while (lex->token.type != TokenType_POUND_ENDFOR)
-            {
-                lex_and_require_valid_token(lex);
-				tokens[token_count++] = lex->token;
-                if (lex->token.type == TokenType_POUND_FOR) 
-				{
-                    report_error_and_exit(lex, "Cannot have nested #for loops!  yet???")
-                }
-            }
+    while (cursor < end && !is_directive_char(*cursor))
+    {
+        if (*cursor == '\n' || (*cursor == '\r' && cursor[1] != '\n'))
+        {
+            line_count++;
+            line_start = cursor + 1;
+        }
+        cursor++;
+    }
 
-            lex_and_expect_token(TokenType_PAREN_OPEN, lex);
-            size_t line_count = lex->line_number - line_begin;
-            lex_and_require_valid_token(lex);
+    if (line_start != NULL)
+    {
+        uint32_t newline_length = 1;
+        if (line_start[-1] == '\n' && line_start - 1 > lex->buffer && line_start[-2] == '\r')
+        {
+            newline_length = 2;
+        }
+        lex->line_number += line_count;
+        lex->line_offset = newline_length + (cursor - line_start);
+    }
+    else
+    {
+        lex->line_offset += cursor - lex->current;
+    }
+    lex->current = cursor;
+}
 
-            typedef enum {
-                ProcedureType_TEXT,
-                ProcedureType_LINE,
-                ProcedureType_LINE_CLIP,
-				ProcedureType_WORD,
-            } ProcedureType;
+//=========================================================
+// Scope table
+//=========================================================
 
-            typedef struct {
-                ProcedureType type;
-                union
-                {
-                    struct //Text
-                    {
-                        const char *text;
-                        size_t length;
-                    };
-                    struct //LineClip
-                    {
-                        size_t arg0;
-                        size_t arg1;
-                    };
-					struct //Word
-					{
-						int wordIndex;
-					};
-                };
-            } Procedure;
-
-            Procedure procedures[128];
-            size_t current_proc_count = 0;
-
-#if 0
-            const char *procedure_input = lex->token.text;
-            int paren_level = 1;
-            while (paren_level > 0)
-            {
-                lex_and_require_valid_token(lex);
-                if (lex->token.type == TokenType_PAREN_OPEN)
-                    paren_level++;
-                else if (lex->token.type == TokenType_PAREN_CLOSE)
-                    paren_level--;
-            }
-#endif
+//Literals never run past the end of their line, so a missing quote can
+//only throw off one line
+
+static inline TokenType peek_token_type(const char *buffer, const char *end,
+    const char *cursor, const char **token_end)
+{
+    Lexer lex = {};
+    lex.buffer = buffer;
+    lex.buffer_size = end - buffer;
+    lex.current = cursor;
+    lex_next_token_and_whitespace(&lex);
+    *token_end = lex.current;
+    return lex.token.type;
+}
 
-			auto parse_procedures = [](Lexer *lex)
-			{
-			};
+//A quote right after a digit is a digit separator (1'000)
+static inline bool is_digit_separator(const char *buffer, const char *cursor)
+{
+    return cursor > buffer && is_number(cursor[-1]);
+}
 
-            int paren_level = 1;
-            while (paren_level > 0)
-            {
-                const char *current_text = lex->token.text;
-                while (lex->token.type < TokenType_POUND || lex->token.type > TokenType_POUND_REPLACE)
-                {
-                    if (lex->token.type == TokenType_PAREN_OPEN)
-                    {
-                        paren_level++;
-                    } else if (lex->token.type == TokenType_PAREN_CLOSE)
-                    {
-                        paren_level--;
-                        if (paren_level == 0)
-                        {
-                            break;
-                        }
-                    }
-                    lex_and_require_valid_token(lex);
-                }
+static inline const char *skip_quoted_text(const char *cursor, const char *end)
+{
+    char quote = *cursor++;
+    while (cursor < end)
+    {
+        char c = *cursor;
+        if (c == quote) return cursor + 1;
+        if (c == '\n' || c == '\r') return cursor;
+        if (c == '\\' && cursor + 1 < end && cursor[1] != '\n' && cursor[1] != '\r') cursor++;
+        cursor++;
+    }
+    return end;
+}
 
-                Procedure *textProc = &procedures[current_proc_count++];
-                textProc->type = ProcedureType_TEXT;
-                textProc->text = current_text;
-                textProc->length = lex->token.text - current_text;
-                if (lex->token.type == TokenType_POUND_LINE)
-                {
-                    Procedure lineProc = {};
-                    lineProc.type = ProcedureType_LINE;
-                    procedures[current_proc_count++] = lineProc;
-                } 
-				else if (lex->token.type == TokenType_POUND_LINE_CLIP)
-                {
-                    Procedure *proc = &procedures[current_proc_count++];
-                    proc->type = ProcedureType_LINE_CLIP;
-                    lex_and_expect_token(TokenType_PAREN_OPEN, lex);
-                    lex_and_expect_token(TokenType_INTEGER, lex);
-                    proc->arg0 = to_int(lex->token);
-                    lex_and_expect_token(TokenType_COMMA, lex);
-                    lex_and_expect_token(TokenType_INTEGER, lex);
-                    proc->arg1 = to_int(lex->token);
-                    lex_and_expect_token(TokenType_PAREN_CLOSE, lex);
-                }
-				else if (lex->token.type == TokenType_POUND_WORD)
-				{
-					Procedure *proc = &procedures[current_proc_count++];
-					proc->type = ProcedureType_WORD;
-					lex_and_expect_token(TokenType_PAREN_OPEN, lex);
-					lex_and_expect_token(TokenType_INTEGER, lex);
-					proc->wordIndex = to_int(lex->token);
-					lex_and_expect_token(TokenType_PAREN_CLOSE, lex);
-				}
-                lex_next_token(lex);
-            }
+static inline const char *find_block_comment_end(const char *cursor, const char *end)
+{
+    while (cursor < end)
+    {
+        cursor = (const char *)memchr(cursor, '*', end - cursor);
+        if (cursor == NULL) return NULL;
+        if (cursor + 1 < end && cursor[1] == '/') return cursor + 2;
+        cursor++;
+    }
+    return NULL;
+}
+
+static const char *skip_for_lines_text(const char *buffer, const char *cursor, const char *end)
+{
+    cursor += static_strlen("#fl");
+    size_t loop_depth = 1;
+    while (loop_depth > 0)
+    {
+        cursor = (const char *)memchr(cursor, '#', end - cursor);
+        if (cursor == NULL) return NULL;
+        const char *token_end;
+        TokenType type = peek_token_type(buffer, end, cursor, &token_end);
+        cursor = token_end;
+        if (type == TokenType_POUND_FOR) loop_depth++;
+        else if (type == TokenType_POUND_ENDFOR) loop_depth--;
+    }
+
+    int paren_level = 0;
+    for (; cursor < end; cursor++)
+    {
+        if (*cursor == '(')
+        {
+            paren_level++;
+        }
+        else if (*cursor == ')')
+        {
+            if (--paren_level == 0) return cursor + 1;
+        }
+        else if (paren_level == 0 && *cursor != ' ' && *cursor != '\t')
+        {
+            return cursor;
+        }
+    }
+    return NULL;
+}
 
+static const char *build_scope_table(Lexer *lex, EditState *edit)
+{
+    const char *buffer = lex->buffer;
+    const char *end = buffer + lex->buffer_size;
+    const char *cursor = buffer;
+    const char *unfinished = NULL;
+    uint32_t current = SCOPE_NONE;
+    while (true)
+    {
+        cursor = find_scope_char(cursor, end);
+        if (cursor >= end) break;
 
-			buffer_read_pos = lex->token.text;
+        switch (*cursor)
+        {
+            case '{':
+            {
+                Scope *scope = push_array_element(&edit->arena, edit->scopes, edit->scope_count, edit->scope_capacity);
+                scope->begin = cursor + 1;
+                scope->end = end;
+                scope->parent = current;
+                scope->depth = current == SCOPE_NONE ? 0 : edit->scopes[current].depth + 1;
+                scope->replace_scope_index = -1;
+                current = (uint32_t)(edit->scope_count - 1);
+                cursor++;
+            } break;
 
-#if 0
-            const char *input_read_pos = procedure_input;
-            size_t proc_input_length = (lex->token.text - procedure_input);
-            for (size_t i = 0; i < proc_input_length; i++)
+            case '}':
             {
-                if (procedure_input[i] == '#')
+                //A stray '}' at file scope does not end the file
+                if (current != SCOPE_NONE)
                 {
-                    if (matches_keyword(&procedure_input[i + 1], "line"))
-                    {
-                        Procedure textProc = {};
-                        textProc.type = ProcedureType_TEXT;
-                        textProc.text = input_read_pos;
-                        textProc.length = &procedure_input[i] - input_read_pos;
-                        procedures[current_proc_count++] = textProc;
-                        i += static_strlen("#line");
-                        input_read_pos = &procedure_input[i];
-
-                        if (matches_keyword(&procedure_input[i + 1 + static_strlen("line")])
-                        {
-                        } else
-                        {
-                        }
-                    }
+                    edit->scopes[current].end = cursor;
+                    current = edit->scopes[current].parent;
                 }
-            }
+                cursor++;
+            } break;
 
-            size_t remaining_text_length = proc_input_length - (input_read_pos - procedure_input);
-            if (remaining_text_length > 0)
+            case '"':
             {
-                Procedure proc = {};
-                proc.type = ProcedureType_TEXT;
-                proc.text = input_read_pos;
-                proc.length = remaining_text_length;
-                procedures[current_proc_count++] = proc;
-            }
+                cursor = skip_quoted_text(cursor, end);
+            } break;
 
-#endif
-#define writebuffer(buffer, data, length) memcpy(buffer, data, length); buffer += length;
-			char temp_buffer[4096];
-			char *write_pos = temp_buffer;
-
-			//XXX make sure token index is set to the first line in the for loop!
-
-			Token *token = tokens;
-			for (size_t i = 0; i < line_count; i++)
-			{
-				Token *first_token_in_line = token;
-				if (token->type == TokenType_NEWLINE)
-				{
-					*write_pos++ = '\n';
-					token++;
-					continue;	
-				}
-
-				while (token->type == TokenType_WHITESPACE)
-					token++;
-				
-				if (token->type == TokenType_COMMENT)
-				{
-					size_t write_length = token->text - first_token_in_line->text;
-					memcpy(write_pos, first_token_in_line->text, write_length);
-					write_pos += write_length;
-					continue;
-				}
-
-				while (token->type != TokenType_NEWLINE)
-					token++;
-
-				for (size_t n = 0; n < current_proc_count; n++)
-				{
-					Procedure *proc = &procedures[n];
-					switch (proc->type)
-					{
-					
-						case ProcedureType_TEXT:
-						{
-							memcpy(write_pos, proc->text, proc->length);
-							write_pos += proc->length;
-						} break;
-					
-						case ProcedureType_LINE:
-						{
-							size_t write_size = (token->text + token->length) - first_token_in_line->text;
-							memcpy(write_pos, first_token_in_line->text, write_size);
-							write_pos += write_size;
-						} break;
-
-						case ProcedureType_LINE_CLIP:
-						{
-							size_t line_length = token->text - first_token_in_line->text;
-							size_t write_size = line_length - proc->arg1 - proc->arg0;
-							memcpy(write_pos, first_token_in_line->text, write_size);
-							write_pos += write_size;
-						} break;
-
-						case ProcedureType_WORD:
-						{
-							Token *word_token = first_token_in_line;
-							int word_index = -1;
-							while (1)
-							{
-								while (word_token->type != TokenType_IDENTIFIER)
-									word_token++;
-								word_index += 1;
-								if (word_index == proc->wordIndex)
-								{
-									break;
-								}
-								else
-								{
-									word_token++;
-								}
-							}
-							memcpy(write_pos, word_token->text, word_token->length);
-							write_pos += word_token->length;
-						} break;
-				}
-			}
-
-			token++;
-			memcpy(write_pos, "\n", 1);
-			write_pos += 1;
-		}
-		push_edit_result(temp_buffer, write_pos - temp_buffer);
-	}
-#if 0
-
-#define writebuffer(buffer, data, length) memcpy(buffer, data, length); buffer += length;
-			char temp_buffer[4096];
-			char *write_pos = temp_buffer;
-			const char *line_head = buffer_read_pos;
-			const char *line_cursor = buffer_read_pos;
-			const char *whitespace_end = line_head;
-			buffer_read_pos = lex->token.text;
-			
-			for (size_t i = 0; i < line_count; i++)
-            {
-                bool line_is_comment = false;
-                while (is_whitespace(*whitespace_end))
+            case '\'':
+            {
+                cursor = is_digit_separator(buffer, cursor) ? cursor + 1 : skip_quoted_text(cursor, end);
+            } break;
+
+            case '/':
+            {
+                if (cursor[1] == '/')
                 {
-                    if (is_end_of_line(whitespace_end))
-                    {
-                        line_count--;
-                        if (i >= line_count) break;
-                    }
-                    whitespace_end++;
+                    cursor = find_line_break(cursor, end);
+                }
+                else if (cursor[1] == '*')
+                {
+                    const char *comment_end = find_block_comment_end(cursor + 2, end);
+                    if (comment_end == NULL && current == SCOPE_NONE) unfinished = cursor;
+                    cursor = comment_end ? comment_end : end;
+                }
+                else
+                {
+                    cursor++;
                 }
+            } break;
 
-                line_cursor = whitespace_end;
-                while (!is_end_of_line(line_cursor))
+            case '#':
+            {
+                const char *token_end;
+                if (peek_token_type(buffer, end, cursor, &token_end) == TokenType_POUND_FOR)
                 {
-                    if (line_cursor[0] == '/' && line_cursor[1] == '/')
+                    token_end = skip_for_lines_text(buffer, cursor, end);
+                    if (token_end == NULL)
                     {
-                        if (line_cursor == whitespace_end)
-                        {
-                            line_is_comment = true;
-                        } else
-                        {
-                            //TODO(Torin)
-                            //Comment and end of line should be ignored!
-                        }
+                        if (current == SCOPE_NONE) unfinished = cursor;
+                        token_end = end;
                     }
-                    line_cursor++;
                 }
+                cursor = token_end;
+            } break;
+        }
+    }
 
+    if (current != SCOPE_NONE)
+    {
+        while (edit->scopes[current].parent != SCOPE_NONE) current = edit->scopes[current].parent;
+        unfinished = edit->scopes[current].begin - 1;
+    }
+    return unfinished;
+}
 
+//=========================================================
+// For lines
+//=========================================================
 
-                size_t whitespace_length = whitespace_end - line_head;
-                size_t line_length = line_cursor - whitespace_end;
-                memcpy(write_pos, line_head, whitespace_length);
-                write_pos += whitespace_length;
+//Splitting an inner loop's expansion into lines of the loop around it gives
+//the same result as expanding it alone and running ductus a second time
 
-                if (line_is_comment)
-                {
-                    writebuffer(write_pos, whitespace_end, line_length);
-                } 
+typedef enum {
+    ProcedureType_TEXT,
+    ProcedureType_LINE,
+    ProcedureType_LINE_CLIP,
+    ProcedureType_WORD,
+} ProcedureType;
 
+typedef struct {
+    ProcedureType type;
+    union
+    {
+        struct //Text
+        {
+            const char *text;
+            size_t length;
+        };
+        struct //LineClip
+        {
+            size_t arg0;
+            size_t arg1;
+        };
+        struct //Word
+        {
+            size_t wordIndex;
+        };
+    };
+} Procedure;
 
-				else
-                {
-                    for (size_t n = 0; n < current_proc_count; n++)
-                    {
-                        Procedure *proc = &procedures[n];
-                        switch (proc->type)
-                        {
-                        case ProcedureType_TEXT:
-                        {
-                            memcpy(write_pos, proc->text, proc->length);
-                            write_pos += proc->length;
-                        } break;
-                        case ProcedureType_LINE:
-                        {
-                            memcpy(write_pos, whitespace_end, line_length);
-                            write_pos += line_length;
-                        } break;
-                        case ProcedureType_LINE_CLIP:
-                        {
-                            writebuffer(write_pos, whitespace_end + proc->arg0, line_length - proc->arg1 - proc->arg0);
-                        } break;
-						case ProcedureType_WORD:
-						{
-
-							//NOTE(Torin) this is bad and will do bad things if it finds a number like 0xFF
-							const char *word_begin = whitespace_end;
-							int current_word_index = -1;
-							while (current_word_index != proc->wordIndex)
-							{
-								if (is_alpha(*word_begin) || *word_begin == '_')
-								{
-									current_word_index++;
-									if (current_word_index == proc->wordIndex)
-									{
-										break;
-									}
-									else
-									{
-										while (is_alpha(*word_begin) || is_number(*word_begin) || *word_begin == '_')
-										{
-											word_begin++;
-										}
-									}
-								}
-								else
-								{
-									word_begin++;
-								}
-							}
-
-							size_t write_length = word_begin - whitespace_end;
-							writebuffer(write_pos, word_begin, write_length);
-
-						} break;
-                        };
-                    }
+typedef enum {
+    ForLineType_EMPTY,
+    ForLineType_COMMENT,
+    ForLineType_TEXT,
+} ForLineType;
 
+typedef struct {
+    ForLineType type;
+    const char *line_begin;   //Start of the line including indentation
+    const char *text_begin;   //First token in the line
+    const char *text_end;     //Start of the newline
+    const char *newline_end;
+    uint32_t first_word;
+    uint32_t word_count;
+} ForLine;
 
-                }
+typedef struct {
+    const char *text;
+    size_t length;
+} ForWord;
 
-                const char *next_line_head = seek_to_next_line(line_cursor);
-                size_t new_line_count = 1;
-                while (is_end_of_line(next_line_head))
-                {
-                    new_line_count++;
-                    next_line_head = seek_to_next_line(next_line_head);
-                }
-                i += (new_line_count - 1);
+typedef struct {
+    ForLine *lines;
+    size_t line_count;
+    size_t line_capacity;
 
-                for (size_t n = 0; n < new_line_count; n++)
-                {
-                    memcpy(write_pos, "\n", 1);
-                    write_pos++;
-                }
+    ForWord *words;
+    size_t word_count;
+    size_t word_capacity;
+} ForLineTable;
 
-                line_head = next_line_head;
-                line_cursor = line_head;
-                whitespace_end = line_cursor;
-            }
-#endif
+//For any procedure but TEXT offset 0 is the start of its output and 1 the
+//end.  The newline at the end of every line is procedure procedure_count
+typedef struct {
+    TokenType type;           //IDENTIFIER, NEWLINE, COMMENT, POUND_LINE or INVALID for anything else
+    uint32_t begin_procedure;
+    uint32_t begin_offset;
+    uint32_t end_procedure;
+    uint32_t end_offset;
+} ProgramToken;
 
-        //@Replace
-        else if (lex->token.type == TokenType_POUND_REPLACE)
-        {
-            size_t edit_size;
-            if (current_block == NULL)
-            {
-                edit_size = buffer_read_pos - lex->buffer;
-            }
-            else
-            {
-                edit_size = current_block - buffer_read_pos;
-            }
+typedef struct {
+    Procedure *procedures;
+    size_t procedure_count;
+    size_t procedure_capacity;
 
+    ProgramToken *tokens;         //NULL when every line of output is lexed
+    size_t token_count;
+    size_t token_capacity;
+    uint32_t word_limit;          //Lines with fewer words leave a #w empty and are lexed
+    uint32_t *procedure_offsets;  //Where the output of each procedure starts in the current line
+} ExpansionProgram;
 
-            push_edit_result(buffer_read_pos, edit_size);
-            buffer_read_pos += edit_size;
+typedef struct {
+    const char *begin;        //The #fl itself
+    const char *line_begin;
+    ForLine *line;            //The line being built, NULL between lines
+    ForLineTable table;
+} ForLoop;
 
-            const char *skip_begin = lex->token.text;
-            bool eat_replace_token = false;
 
+static const char *parse_expansion_program(Lexer *lex, EditState *edit, ExpansionProgram *program)
+{
+#define push_procedure() push_array_element(&edit->scratch, program->procedures, program->procedure_count, program->procedure_capacity)
+    int paren_level = 1;
+    const char *program_end = NULL;
+    while (paren_level > 0)
+    {
+        const char *current_text = lex->token.text;
+        while (lex->token.type < TokenType_POUND || lex->token.type > TokenType_POUND_REPLACE)
+        {
+            if (lex->token.type == TokenType_PAREN_OPEN)
+            {
+                paren_level++;
+            } else if (lex->token.type == TokenType_PAREN_CLOSE)
             {
-                const char *temp_seeker = lex->token.text;
-                while (*temp_seeker != '\n')
+                paren_level--;
+                if (paren_level == 0)
                 {
-                    if (!is_whitespace(*temp_seeker) || temp_seeker == lex->token.text) {
-                        eat_replace_token = true;
-                        break;
-                    }
-                    temp_seeker--;
+                    break;
                 }
             }
-
             lex_and_require_valid_token(lex);
+        }
 
-            typedef struct {
-                const char *text;
-                size_t length;
-            } String;
-
-            String arg0, arg1;
-            while(lex->token.type == TokenType_WHITESPACE)
-                lex_and_require_valid_token(lex);
-            ensure_token(lex, TokenType_IDENTIFIER);
+        if (lex->token.text > current_text)
+        {
+            Procedure *textProc = push_procedure();
+            textProc->type = ProcedureType_TEXT;
+            textProc->text = current_text;
+            textProc->length = lex->token.text - current_text;
+        }
 
-            arg0.text = lex->token.text;
-            arg0.length = lex->token.length;
+        if (lex->token.type == TokenType_POUND_LINE)
+        {
+            Procedure *proc = push_procedure();
+            proc->type = ProcedureType_LINE;
+        }
+        else if (lex->token.type == TokenType_POUND_LINE_CLIP)
+        {
+            Procedure *proc = push_procedure();
+            proc->type = ProcedureType_LINE_CLIP;
+            lex_and_expect_token(TokenType_PAREN_OPEN, lex);
+            lex_and_expect_token(TokenType_INTEGER, lex);
+            proc->arg0 = to_int(lex->token);
+            lex_and_expect_token(TokenType_COMMA, lex);
+            lex_and_expect_token(TokenType_INTEGER, lex);
+            proc->arg1 = to_int(lex->token);
+            lex_and_expect_token(TokenType_PAREN_CLOSE, lex);
+        }
+        else if (lex->token.type == TokenType_POUND_WORD)
+        {
+            Procedure *proc = push_procedure();
+            proc->type = ProcedureType_WORD;
+            lex_and_expect_token(TokenType_PAREN_OPEN, lex);
+            lex_and_expect_token(TokenType_INTEGER, lex);
+            proc->wordIndex = to_int(lex->token);
+            lex_and_expect_token(TokenType_PAREN_CLOSE, lex);
+        }
+        program_end = lex->token.text + lex->token.length;
+        lex_next_token(lex);
+    }
+#undef push_procedure
+    return program_end;
+}
 
-            lex_and_require_valid_token(lex);
-            while(lex->token.type == TokenType_WHITESPACE)
-                lex_and_require_valid_token(lex);
-            ensure_token(lex, TokenType_IDENTIFIER);
+static inline size_t expand_for_line(const ExpansionProgram *program, const ForLineTable *table,
+    const ForLine *line, char *output, uint32_t *procedure_offsets)
+{
+    size_t length = 0;
+#define emit(data, size) { if (output) memcpy(output + length, data, size); length += size; }
+    if (line->type == ForLineType_EMPTY)
+    {
+        emit("\n", 1);
+        return length;
+    }
 
-            arg1.text = lex->token.text;
-            arg1.length = lex->token.length;
+    if (line->type == ForLineType_COMMENT)
+    {
+        emit(line->line_begin, (size_t)(line->newline_end - line->line_begin));
+        return length;
+    }
 
+    for (size_t i = 0; i < program->procedure_count; i++)
+    {
+        const Procedure *proc = &program->procedures[i];
+        if (procedure_offsets) procedure_offsets[i] = (uint32_t)length;
+        switch (proc->type)
+        {
+            case ProcedureType_TEXT:
             {
-                if (eat_replace_token == true)
-                {
-                    const char *temp_seeker = lex->token.text + lex->token.length;
-                    while (*temp_seeker != '\n' && *temp_seeker != 0)
-                    {
-                        if (!is_whitespace(*temp_seeker))
-                        {
-                            eat_replace_token = false;
-                            break;
-                        }
-                        temp_seeker++;
-                    }
-                }
-            }
+                emit(proc->text, proc->length);
+            } break;
 
-            const char *skip_end = lex->token.text;
-            lex_next_token(lex);
-
-            if (eat_replace_token)
+            case ProcedureType_LINE:
             {
-                skip_end = lex->token.text;
-            }
+                emit(line->text_begin, (size_t)(line->newline_end - line->text_begin));
+            } break;
 
-            const char *search_begin;
-            const char *search_end;
-            if (current_block == NULL)
+            case ProcedureType_LINE_CLIP:
             {
-                search_begin = lex->buffer;
-                search_end = lex->buffer + lex->buffer_size;
-            }
-            else
-            {
-                search_begin = current_block;
-                int brace_level = current_block != NULL;
-                while (brace_level > 0)
+                size_t line_length = line->text_end - line->text_begin;
+                if (proc->arg0 + proc->arg1 < line_length)
                 {
-                    if (lex->token.type == TokenType_BRACE_OPEN)
-                        brace_level++;
-					else if (lex->token.type == TokenType_BRACE_CLOSE)
-						brace_level--;
-                    lex_next_token(lex);
+                    emit(line->text_begin + proc->arg0, line_length - proc->arg1 - proc->arg0);
                 }
+            } break;
 
-                search_end = lex->token.text + 1;
-            }
-
-            size_t match_read_pos = 0;
-            auto find_and_replace = [&](const char *search_pos, const char *search_end,
-                    String find, String replace)
+            case ProcedureType_WORD:
             {
-                while (search_pos != search_end)
+                if (proc->wordIndex < line->word_count)
                 {
-                    if (*search_pos == arg0.text[match_read_pos])
-                    {
-                        match_read_pos++;
-                        if (match_read_pos == arg0.length)
-                        {
-                            size_t edit_size = (search_pos - arg0.length) - buffer_read_pos + 1;
-                            push_edit_result(buffer_read_pos, edit_size);
-                            buffer_read_pos += edit_size + find.length;
-                            push_edit_result(replace.text, replace.length);
-                            match_read_pos = 0;
-                        }
-                    }
-                    else
-                    {
-                        match_read_pos = 0;
-                    }
-                    search_pos++;
+                    const ForWord *word = &table->words[line->first_word + proc->wordIndex];
+                    emit(word->text, word->length);
                 }
-            };
-
-            find_and_replace(search_begin, skip_begin, arg0, arg1);
-            size_t write_size = skip_begin - buffer_read_pos;
-            push_edit_result(buffer_read_pos, write_size);
-            buffer_read_pos += write_size;
-            buffer_read_pos += (skip_end - buffer_read_pos);
-            find_and_replace(skip_end, search_end, arg0, arg1);
-        }
-
-        //Eat strings
-        else if (lex->token.type == TokenType_QUOTE)
-        {
-            while (lex->token.type != TokenType_QUOTE)
-            {
-                lex_and_require_valid_token(lex);
-            }
-            lex_and_require_valid_token(lex);
+            } break;
         }
     }
 
+    if (procedure_offsets) procedure_offsets[program->procedure_count] = (uint32_t)length;
+    emit("\n", 1);
+    if (procedure_offsets) procedure_offsets[program->procedure_count + 1] = (uint32_t)length;
+#undef emit
+    return length;
 }
 
-int main(int argc, char** argv)
+static char *expand_for_loop(EditState *edit, const ExpansionProgram *program, const ForLineTable *table,
+    size_t *expansion_length)
 {
-    if (argc < 2)
+    *expansion_length = 0;
+    for (size_t i = 0; i < table->line_count; i++)
     {
-        printf("You must provide a filename!\n");
-        return -1;
+        *expansion_length += expand_for_line(program, table, &table->lines[i], NULL, NULL);
     }
 
-    char *file_buffer;
-    size_t file_size;
+    char *expansion = (char *)arena_allocate(&edit->arena, *expansion_length + 1);
+    char *write_pos = expansion;
+    for (size_t i = 0; i < table->line_count; i++)
     {
-        FILE* file = fopen(argv[1], "rb");
-        if (file == NULL) {
-            printf("Could not open file %s\n", argv[1]);
-            return 1;
+        write_pos += expand_for_line(program, table, &table->lines[i], write_pos, NULL);
+    }
+    *write_pos = 0;
+    return expansion;
+}
+
+static void push_for_line_token(EditState *edit, ForLoop *loop, const Token *token)
+{
+    ForLineTable *table = &loop->table;
+    if (token->type == TokenType_NEWLINE)
+    {
+        if (loop->line == NULL)
+        {
+            loop->line = push_array_element(&edit->scratch, table->lines, table->line_count, table->line_capacity);
+            loop->line->type = ForLineType_EMPTY;
+            loop->line->text_begin = token->text;
+            loop->line->first_word = (uint32_t)table->word_count;
+            loop->line->word_count = 0;
         }
-        fseek(file, 0, SEEK_END);
-        file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        file_buffer = (char*)malloc(file_size + 1);
-        file_buffer[file_size] = 0;
-        fread(file_buffer, 1, file_size, file);
-        fclose(file);
+        loop->line->line_begin = loop->line_begin;
+        loop->line->text_end = token->text;
+        loop->line->newline_end = token->text + token->length;
+        loop->line_begin = loop->line->newline_end;
+        loop->line = NULL;
+        return;
     }
 
-	Lexer lex;
-    lex.buffer_size = file_size;
-    lex.buffer = file_buffer;
-    lex.current = file_buffer;
-    lex.line_number = 0;
-    lex.line_offset = 0;
-    lex.is_first_token_in_line = true;
-    lex.token.type = TokenType_INVALID;
-	
-    buffer_read_pos = file_buffer;
-    parse_block(&lex, NULL);
+    if (loop->line == NULL)
+    {
+        loop->line = push_array_element(&edit->scratch, table->lines, table->line_count, table->line_capacity);
+        loop->line->type = token->type == TokenType_COMMENT ? ForLineType_COMMENT : ForLineType_TEXT;
+        loop->line->text_begin = token->text;
+        loop->line->first_word = (uint32_t)table->word_count;
+        loop->line->word_count = 0;
+    }
 
-    size_t offset = lex.token.text - buffer_read_pos;
-    push_edit_result(buffer_read_pos, offset);
+    if (token->type == TokenType_IDENTIFIER)
+    {
+        ForWord *word = push_array_element(&edit->scratch, table->words, table->word_count, table->word_capacity);
+        word->text = token->text;
+        word->length = token->length;
+        loop->line->word_count++;
+    }
+}
 
-    FILE *file = fopen(argv[1], "wb");
-    if (file == NULL) return 1;
+static void push_generated_lines(Lexer *lex, EditState *edit, ForLoop *loop, const char *text, const char *end)
+{
+    Lexer generated = {};
+    generated.buffer = text;
+    generated.buffer_size = end - text;
+    generated.current = text;
+    generated.line_number = lex->line_number;
+    generated.filename = lex->filename;
+    generated.error_jump = lex->error_jump;
+    generated.top_level_boundary = text;
 
-    EditResult *current_edit = g_root_edit_result;
-    while (current_edit != NULL)
+    while (generated.current < end)
     {
-        fwrite(current_edit->buffer, 1, current_edit->size, file);
-        current_edit = current_edit->next;
+        lex_next_token(&generated);
+        push_for_line_token(edit, loop, &generated.token);
     }
+}
 
-    fclose(file);
+//Every #w lexes as one identifier whatever it is and #l ends the line, so
+//the same tokens come out on every line and only where they sit moves
+static void compile_program_tokens(Lexer *lex, EditState *edit, ExpansionProgram *program)
+{
+    program->procedure_offsets = (uint32_t *)arena_allocate(&edit->scratch, sizeof(uint32_t) * (program->procedure_count + 2));
 
-#if 0
-    char input_char = 0;
-    printf("Undo Changes(Y/N)?\n");
-    scanf("%c", &input_char);
-    if (input_char == 'Y' || input_char == 'y') {
-        FILE *file = fopen(argv[1], "w");
-        if (file == NULL) return 1;
-        fwrite(file_buffer, 1, file_size, file);
-        fclose(file);
+    size_t representative_length = 2;
+    for (size_t i = 0; i < program->procedure_count; i++)
+    {
+        const Procedure *proc = &program->procedures[i];
+        if (proc->type == ProcedureType_LINE_CLIP) return;
+        if (proc->type == ProcedureType_TEXT)
+        {
+            for (size_t n = 0; n < proc->length; n++)
+            {
+                char c = proc->text[n];
+                if (c == '#' || c == '\n' || c == '\r') return;
+            }
+        }
+        representative_length += proc->type == ProcedureType_TEXT ? proc->length : 2;
+    }
+
+    char *representative = (char *)arena_allocate(&edit->scratch, representative_length);
+    uint32_t *starts = (uint32_t *)arena_allocate(&edit->scratch, sizeof(uint32_t) * (program->procedure_count + 2));
+    size_t length = 0;
+    for (size_t i = 0; i < program->procedure_count; i++)
+    {
+        const Procedure *proc = &program->procedures[i];
+        starts[i] = (uint32_t)length;
+        if (proc->type == ProcedureType_TEXT)
+        {
+            memcpy(representative + length, proc->text, proc->length);
+            length += proc->length;
+        }
+        else if (proc->type == ProcedureType_WORD)
+        {
+            representative[length++] = 'a';
+            if (proc->wordIndex + 1 > program->word_limit) program->word_limit = (uint32_t)proc->wordIndex + 1;
+        }
+        else
+        {
+            if (length > 0)
+            {
+                char c = representative[length - 1];
+                if (is_alpha(c) || is_number(c) || c == '_' || c == '.' || c == '/') return;
+            }
+            representative[length++] = '=';
+            representative[length++] = '\n';
+        }
+    }
+    starts[program->procedure_count] = (uint32_t)length;
+    representative[length++] = '\n';
+    starts[program->procedure_count + 1] = (uint32_t)length;
+    representative[length] = 0;
+
+    Lexer generated = {};
+    generated.buffer = representative;
+    generated.buffer_size = length;
+    generated.current = representative;
+    generated.line_number = lex->line_number;
+    generated.filename = lex->filename;
+    generated.error_jump = lex->error_jump;
+    generated.top_level_boundary = representative;
+
+    bool line_has_token = false;
+    uint32_t procedure = 0;
+    while (true)
+    {
+        lex_next_token(&generated);
+        if (generated.token.type == TokenType_END_OF_BUFFER) break;
+
+        uint32_t begin = (uint32_t)(generated.token.text - representative);
+        uint32_t end = begin + (uint32_t)generated.token.length;
+        while (begin >= starts[procedure + 1]) procedure++;
+        bool is_text = procedure == program->procedure_count || program->procedures[procedure].type == ProcedureType_TEXT;
+        if (!is_text && program->procedures[procedure].type == ProcedureType_LINE)
+        {
+            if (begin == starts[procedure])
+            {
+                ProgramToken *token = push_array_element(&edit->scratch, program->tokens, program->token_count, program->token_capacity);
+                token->type = TokenType_POUND_LINE;
+                token->begin_procedure = procedure;
+                token->begin_offset = 0;
+                token->end_procedure = procedure;
+                token->end_offset = 1;
+            }
+            line_has_token = false;
+            continue;
+        }
+
+        TokenType type = generated.token.type;
+        if (type != TokenType_IDENTIFIER && type != TokenType_NEWLINE)
+        {
+            if (line_has_token) continue;
+            if (type != TokenType_COMMENT) type = TokenType_INVALID;
+        }
+        line_has_token = type != TokenType_NEWLINE;
+
+        uint32_t end_procedure = procedure;
+        while (end > starts[end_procedure + 1]) end_procedure++;
+        bool is_end_text = end_procedure == program->procedure_count || program->procedures[end_procedure].type == ProcedureType_TEXT;
+
+        ProgramToken *token = push_array_element(&edit->scratch, program->tokens, program->token_count, program->token_capacity);
+        token->type = type;
+        token->begin_procedure = procedure;
+        token->begin_offset = is_text ? begin - starts[procedure] : 0;
+        token->end_procedure = end_procedure;
+        token->end_offset = is_end_text ? end - starts[end_procedure] : 1;
+    }
+}
+
+static inline const char *resolve_program_point(const ExpansionProgram *program, const char *line_output,
+    uint32_t procedure, uint32_t offset)
+{
+    const uint32_t *offsets = program->procedure_offsets;
+    if (procedure == program->procedure_count || program->procedures[procedure].type == ProcedureType_TEXT)
+    {
+        return line_output + offsets[procedure] + offset;
+    }
+    return line_output + (offset ? offsets[procedure + 1] : offsets[procedure]);
+}
+
+static void push_copied_words(EditState *edit, ForLoop *loop, const ForLineTable *table,
+    const ForLine *line, const char *from, const char *to)
+{
+    Token token = {};
+    token.type = TokenType_IDENTIFIER;
+    for (uint32_t i = 0; i < line->word_count; i++)
+    {
+        const ForWord *word = &table->words[line->first_word + i];
+        token.text = to + (word->text - from);
+        token.length = word->length;
+        push_for_line_token(edit, loop, &token);
+    }
+
+    token.type = TokenType_NEWLINE;
+    token.text = to + (line->text_end - from);
+    token.length = line->newline_end - line->text_end;
+    push_for_line_token(edit, loop, &token);
+}
+
+static void push_expanded_line(Lexer *lex, EditState *edit, ForLoop *outer, const ExpansionProgram *program,
+    const ForLineTable *table, const ForLine *line, const char *line_output, const char *line_end)
+{
+    Token token = {};
+    if (line->type == ForLineType_EMPTY)
+    {
+        token.type = TokenType_NEWLINE;
+        token.text = line_end - 1;
+        token.length = 1;
+        push_for_line_token(edit, outer, &token);
+        return;
+    }
+
+    if (line->type == ForLineType_COMMENT)
+    {
+        token.type = TokenType_COMMENT;
+        token.text = line_output + (line->text_begin - line->line_begin);
+        token.length = 2;
+        push_for_line_token(edit, outer, &token);
+        push_copied_words(edit, outer, table, line, line->line_begin, line_output);
+        return;
+    }
+
+    if (program->tokens == NULL || line->word_count < program->word_limit)
+    {
+        push_generated_lines(lex, edit, outer, line_output, line_end);
+        return;
+    }
+
+    for (size_t i = 0; i < program->token_count; i++)
+    {
+        const ProgramToken *program_token = &program->tokens[i];
+        if (program_token->type == TokenType_POUND_LINE)
+        {
+            //The first token of the line copied may not be a word
+            const char *copy = resolve_program_point(program, line_output, program_token->begin_procedure, 0);
+            token.type = TokenType_INVALID;
+            token.text = copy;
+            token.length = 0;
+            push_for_line_token(edit, outer, &token);
+            push_copied_words(edit, outer, table, line, line->text_begin, copy);
+            continue;
+        }
+
+        token.type = program_token->type;
+        token.text = resolve_program_point(program, line_output, program_token->begin_procedure, program_token->begin_offset);
+        token.length = resolve_program_point(program, line_output, program_token->end_procedure, program_token->end_offset) - token.text;
+        push_for_line_token(edit, outer, &token);
+    }
+}
+
+//A lone '\r' ending a line would make one newline with the '\n' that
+//starts the next, a table with one is lexed as a whole
+static void expand_inner_loop(Lexer *lex, EditState *edit, ExpansionProgram *program, const ForLineTable *table,
+    ForLoop *outer, size_t indentation_length)
+{
+    size_t expansion_length = indentation_length;
+    bool has_lone_carriage_return = false;
+    for (size_t i = 0; i < table->line_count; i++)
+    {
+        const ForLine *line = &table->lines[i];
+        expansion_length += expand_for_line(program, table, line, NULL, NULL);
+        if (line->newline_end - line->text_end == 1 && *line->text_end == '\r') has_lone_carriage_return = true;
+    }
+
+    char *expansion = (char *)arena_allocate(&edit->scratch, expansion_length + 1);
+    if (indentation_length > 0) memcpy(expansion, outer->line_begin, indentation_length);
+    outer->line_begin = expansion;
+    char *write_pos = expansion + indentation_length;
+    if (has_lone_carriage_return)
+    {
+        for (size_t i = 0; i < table->line_count; i++)
+        {
+            write_pos += expand_for_line(program, table, &table->lines[i], write_pos, NULL);
+        }
+        *write_pos = 0;
+        push_generated_lines(lex, edit, outer, expansion + indentation_length, write_pos);
+        return;
+    }
+
+    compile_program_tokens(lex, edit, program);
+    for (size_t i = 0; i < table->line_count; i++)
+    {
+        char *line_output = write_pos;
+        write_pos += expand_for_line(program, table, &table->lines[i], write_pos, program->procedure_offsets);
+        push_expanded_line(lex, edit, outer, program, table, &table->lines[i], line_output, write_pos);
+    }
+    *write_pos = 0;
+}
+
+static void parse_for_lines(Lexer *lex, EditState *edit)
+{
+    ForLoop *loops = NULL;
+    size_t loop_count = 0, loop_capacity = 0;
+    while (true)
+    {
+        if (lex->token.type == TokenType_POUND_FOR)
+        {
+            if (loop_count > 0 && loops[loop_count - 1].line != NULL)
+            {
+                report_error_and_exit(lex, "A nested #fl has to start on its own line");
+            }
+
+            ForLoop *new_loop = push_array_element(&edit->scratch, loops, loop_count, loop_capacity);
+            memset(new_loop, 0, sizeof(ForLoop));
+            new_loop->begin = lex->token.text;
+            lex_and_require_valid_token(lex);
+            new_loop->line_begin = lex->token.text + lex->token.length;
+            lex_and_require_valid_token(lex);
+            continue;
+        }
+
+        ForLoop *loop = &loops[loop_count - 1];
+        ForLineTable *table = &loop->table;
+
+        if (lex->token.type == TokenType_POUND_ENDFOR)
+        {
+            if (loop->line != NULL)
+            {
+                table->line_count--;
+                table->word_count = loop->line->first_word;
+            }
+
+            lex_and_expect_token(TokenType_PAREN_OPEN, lex);
+            lex_and_require_valid_token(lex);
+            ExpansionProgram program = {};
+            const char *program_end = parse_expansion_program(lex, edit, &program);
+
+            loop_count--;
+            if (loop_count == 0)
+            {
+                size_t expansion_length;
+                char *expansion = expand_for_loop(edit, &program, table, &expansion_length);
+                push_source_edit(edit, loop->begin, lex->token.text, expansion, expansion_length);
+                return;
+            }
+
+            //At file level the whitespace up to that token goes with the loop,
+            //here it stays like it would if the inner loop ran on its own
+            ForLoop *outer = &loops[loop_count - 1];
+            size_t indentation_length = table->line_count > 0 ? loop->begin - outer->line_begin : 0;
+            expand_inner_loop(lex, edit, &program, table, outer, indentation_length);
+            outer->line_begin = program_end;
+            continue;
+        }
+
+        push_for_line_token(edit, loop, &lex->token);
+        lex_and_require_valid_token(lex);
+    }
+}
+
+typedef struct {
+    uint32_t current_scope;
+    int file_replace_scope_index;
+    double expand_seconds;
+} DirectiveState;
+
+typedef void ProcedureHandler(Lexer *lex, EditState *edit, DirectiveState *state);
+
+static void run_for_lines_procedure(Lexer *lex, EditState *edit, DirectiveState *state)
+{
+    double expand_begin = get_seconds();
+    parse_for_lines(lex, edit);
+    rewind_arena(&edit->scratch);
+    state->expand_seconds += get_seconds() - expand_begin;
+}
+
+//@Replace
+static void run_identifier_procedure(Lexer *lex, EditState *edit, DirectiveState *state)
+{
+    TokenType directive = lex->token.type;
+    const char *skip_begin = lex->token.text;
+
+    lex_and_require_valid_token(lex);
+
+    typedef struct {
+        const char *text;
+        size_t length;
+    } String;
+
+    String arg0, arg1;
+    while(lex->token.type == TokenType_WHITESPACE)
+        lex_and_require_valid_token(lex);
+    ensure_token(lex, TokenType_IDENTIFIER);
+
+    arg0.text = lex->token.text;
+    arg0.length = lex->token.length;
+
+    arg1.text = "";
+    arg1.length = 0;
+    if (get_procedure_flags(directive) & ProcedureFlag_REPLACEMENT)
+    {
+        lex_and_require_valid_token(lex);
+        while(lex->token.type == TokenType_WHITESPACE)
+            lex_and_require_valid_token(lex);
+        ensure_token(lex, TokenType_IDENTIFIER);
+
+        arg1.text = lex->token.text;
+        arg1.length = lex->token.length;
+    }
+
+    const char *skip_end = arg1.length > 0 ? arg1.text + arg1.length : arg0.text + arg0.length;
+    {
+        const char *temp_seeker = skip_end;
+        while (*temp_seeker == ' ' || *temp_seeker == '\t')
+        {
+            temp_seeker++;
+        }
+        if (*temp_seeker == '\n' || *temp_seeker == '\r' || *temp_seeker == 0)
+        {
+            skip_end = temp_seeker;
+        }
+    }
+
+    //A stream can't go back over text it already wrote, so at file scope
+    //rules only apply from the directive on
+    int rule_scope_index;
+    if (lex->is_streaming && state->current_scope == SCOPE_NONE)
+    {
+        rule_scope_index = (int)edit->replace_scope_count;
+        ReplaceScope *scope = push_array_element(&edit->arena, edit->replace_scopes, edit->replace_scope_count, edit->replace_scope_capacity);
+        scope->begin = skip_begin;
+        scope->end = lex->buffer + lex->buffer_size;
+    }
+    else
+    {
+        int *replace_scope_index = state->current_scope == SCOPE_NONE ? &state->file_replace_scope_index :
+            &edit->scopes[state->current_scope].replace_scope_index;
+        if (*replace_scope_index == -1)
+        {
+            *replace_scope_index = (int)edit->replace_scope_count;
+            ReplaceScope *scope = push_array_element(&edit->arena, edit->replace_scopes, edit->replace_scope_count, edit->replace_scope_capacity);
+            scope->begin = state->current_scope == SCOPE_NONE ? lex->buffer : edit->scopes[state->current_scope].begin;
+            scope->end = state->current_scope == SCOPE_NONE ? lex->buffer + lex->buffer_size : edit->scopes[state->current_scope].end;
+        }
+        rule_scope_index = *replace_scope_index;
+    }
+
+    ReplaceRule *rule = push_array_element(&edit->arena, edit->replace_rules, edit->replace_rule_count, edit->replace_rule_capacity);
+    rule->target = arg0.text;
+    rule->target_length = arg0.length;
+    rule->replacement = arg1.text;
+    rule->replacement_length = arg1.length;
+    rule->scope_index = (uint32_t)rule_scope_index;
+    switch (directive)
+    {
+        case TokenType_POUND_REPLACE_WORD:
+        case TokenType_POUND_DELETE_WORD: rule->kind = ReplaceKind_WORD; break;
+        case TokenType_POUND_POINTER: rule->kind = ReplaceKind_TO_POINTER; break;
+        case TokenType_POUND_VALUE: rule->kind = ReplaceKind_TO_VALUE; break;
+        default: rule->kind = ReplaceKind_TEXT; break;
+    }
+
+    push_source_edit(edit, skip_begin, skip_end, NULL, 0);
+}
+
+static ProcedureHandler *const PROCEDURE_HANDLERS[TokenType_COUNT] =
+{
+#define TokenEntry(name) NULL,
+#define ProcedureEntry(token, name, flags, handler, ...) handler,
+    TokenList
+#undef ProcedureEntry
+#undef TokenEntry
+};
+
+//Every scope is entered and left once, which keeps the walk linear
+static void parse_directives(Lexer *lex, EditState *edit)
+{
+    double lex_begin = get_seconds();
+    DirectiveState state = {};
+    state.current_scope = SCOPE_NONE;
+    state.file_replace_scope_index = -1;
+    uint32_t next_scope = 0;
+    while (true)
+    {
+        lex_skip_to_directive(lex);
+        if (lex->current >= lex->buffer + lex->buffer_size) break;
+        lex_next_token(lex);
+        if (lex->token.type == TokenType_END_OF_BUFFER) break;
+
+        edit->stats.directive_count++;
+        const char *position = lex->token.text;
+        while (next_scope < edit->scope_count && edit->scopes[next_scope].begin <= position)
+        {
+            state.current_scope = next_scope++;
+        }
+        while (state.current_scope != SCOPE_NONE && edit->scopes[state.current_scope].end <= position)
+        {
+            state.current_scope = edit->scopes[state.current_scope].parent;
+        }
+
+        if (state.current_scope == SCOPE_NONE)
+        {
+            lex->top_level_boundary = position;
+        }
+        else
+        {
+            uint32_t top_scope = state.current_scope;
+            while (edit->scopes[top_scope].parent != SCOPE_NONE) top_scope = edit->scopes[top_scope].parent;
+            lex->top_level_boundary = edit->scopes[top_scope].begin - 1;
+        }
+
+        ProcedureHandler *handler = PROCEDURE_HANDLERS[lex->token.type];
+        if (handler != NULL) handler(lex, edit, &state);
+    }
+
+    edit->stats.phase_seconds[StatsPhase_EXPAND] += state.expand_seconds;
+    edit->stats.phase_seconds[StatsPhase_LEX] += get_seconds() - lex_begin - state.expand_seconds;
+    edit->stats.token_count += lex->token_count;
+}
+
+static void parse_block(Lexer *lex, EditState *edit)
+{
+    double scopes_begin = get_seconds();
+    const char *unfinished = build_scope_table(lex, edit);
+    edit->stats.phase_seconds[StatsPhase_SCOPES] += get_seconds() - scopes_begin;
+    if (unfinished != NULL && lex->is_partial)
+    {
+        lex->top_level_boundary = unfinished;
+        request_more_input(lex);
+    }
+    parse_directives(lex, edit);
+}
+
+//=========================================================
+// Replacement engine
+//=========================================================
+
+//Every target is an identifier, so the automaton is fed one name at a time
+
+#define IDENTIFIER_CHAR_CLASS_COUNT 64
+
+static inline uint32_t identifier_char_class(char c)
+{
+    if (c >= 'a' && c <= 'z') return 1 + (c - 'a');
+    if (c >= 'A' && c <= 'Z') return 27 + (c - 'A');
+    if (c >= '0' && c <= '9') return 53 + (c - '0');
+    if (c == '_') return 63;
+    return 0;
+}
+
+typedef struct {
+    const char *text;
+    uint32_t length;
+    uint32_t name;
+} SortedName;
+
+static int compare_sorted_names(const void *a, const void *b)
+{
+    const SortedName *name_a = (const SortedName *)a;
+    const SortedName *name_b = (const SortedName *)b;
+    uint32_t length = name_a->length < name_b->length ? name_a->length : name_b->length;
+    int order = memcmp(name_a->text, name_b->text, length);
+    if (order != 0) return order;
+    if (name_a->length != name_b->length) return name_a->length < name_b->length ? -1 : 1;
+    return 0;
+}
+
+//In sorted order each target only adds what it doesn't share with the one before
+static size_t count_trie_states(MemoryArena *arena, const ReplaceRule *rules,
+    const uint32_t *rule_indices, size_t rule_count)
+{
+    SortedName *targets = (SortedName *)arena_allocate(arena, sizeof(SortedName) * (rule_count + 1));
+    for (size_t i = 0; i < rule_count; i++)
+    {
+        targets[i].text = rules[rule_indices[i]].target;
+        targets[i].length = (uint32_t)rules[rule_indices[i]].target_length;
+        targets[i].name = (uint32_t)i;
+    }
+    qsort(targets, rule_count, sizeof(SortedName), compare_sorted_names);
+
+    size_t state_count = 1;
+    for (size_t i = 0; i < rule_count; i++)
+    {
+        uint32_t shared = 0;
+        if (i > 0)
+        {
+            uint32_t length = targets[i].length < targets[i - 1].length ? targets[i].length : targets[i - 1].length;
+            while (shared < length && targets[i].text[shared] == targets[i - 1].text[shared]) shared++;
+        }
+        state_count += targets[i].length - shared;
+    }
+    return state_count;
+}
+
+static void build_replace_automaton(MemoryArena *arena, ReplaceAutomaton *automaton,
+    const ReplaceRule *rules, const uint32_t *rule_indices, size_t rule_count)
+{
+    size_t max_state_count = count_trie_states(arena, rules, rule_indices, rule_count);
+    automaton->rule_index = (int32_t *)arena_allocate(arena, sizeof(int32_t) * max_state_count);
+    automaton->output_link = (int32_t *)arena_allocate(arena, sizeof(int32_t) * max_state_count);
+    int32_t *fail = (int32_t *)arena_allocate(arena, sizeof(int32_t) * max_state_count * 2);
+    int32_t *queue = fail + max_state_count;
+    automaton->transitions = (int32_t *)arena_allocate(arena, sizeof(int32_t) * max_state_count * IDENTIFIER_CHAR_CLASS_COUNT);
+
+    memset(automaton->transitions, 0xFF, sizeof(int32_t) * IDENTIFIER_CHAR_CLASS_COUNT);
+    automaton->rule_index[0] = -1;
+    automaton->output_link[0] = -1;
+    automaton->state_count = 1;
+
+    for (size_t i = 0; i < rule_count; i++)
+    {
+        const ReplaceRule *rule = &rules[rule_indices[i]];
+        int32_t state = 0;
+        for (size_t n = 0; n < rule->target_length; n++)
+        {
+            int32_t *next = &automaton->transitions[state * IDENTIFIER_CHAR_CLASS_COUNT +
+                identifier_char_class(rule->target[n])];
+            if (*next == -1)
+            {
+                int32_t new_state = (int32_t)automaton->state_count++;
+                memset(&automaton->transitions[new_state * IDENTIFIER_CHAR_CLASS_COUNT], 0xFF,
+                    sizeof(int32_t) * IDENTIFIER_CHAR_CLASS_COUNT);
+                automaton->rule_index[new_state] = -1;
+                automaton->output_link[new_state] = -1;
+                *next = new_state;
+            }
+            state = *next;
+        }
+
+        if (automaton->rule_index[state] == -1)
+        {
+            automaton->rule_index[state] = (int32_t)rule_indices[i];
+        }
+    }
+
+    size_t queue_head = 0, queue_tail = 0;
+    for (uint32_t c = 0; c < IDENTIFIER_CHAR_CLASS_COUNT; c++)
+    {
+        int32_t *next = &automaton->transitions[c];
+        if (*next == -1 || c == 0)
+        {
+            *next = 0;
+        }
+        else
+        {
+            fail[*next] = 0;
+            queue[queue_tail++] = *next;
+        }
+    }
+
+    while (queue_head < queue_tail)
+    {
+        int32_t state = queue[queue_head++];
+        int32_t *state_transitions = &automaton->transitions[state * IDENTIFIER_CHAR_CLASS_COUNT];
+        const int32_t *fail_transitions = &automaton->transitions[fail[state] * IDENTIFIER_CHAR_CLASS_COUNT];
+        for (uint32_t c = 0; c < IDENTIFIER_CHAR_CLASS_COUNT; c++)
+        {
+            int32_t next = state_transitions[c];
+            if (next == -1)
+            {
+                state_transitions[c] = fail_transitions[c];
+            }
+            else
+            {
+                int32_t next_fail = fail_transitions[c];
+                fail[next] = next_fail;
+                automaton->output_link[next] = automaton->rule_index[next_fail] != -1 ?
+                    next_fail : automaton->output_link[next_fail];
+                queue[queue_tail++] = next;
+            }
+        }
+    }
+}
+
+static void build_replace_rule_set(MemoryArena *arena, ReplaceRuleSet *set,
+    const ReplaceRule *rules, const uint32_t *rule_indices, size_t rule_count)
+{
+    ReplaceAutomaton *automaton = &set->automaton;
+    build_replace_automaton(arena, automaton, rules, rule_indices, rule_count);
+    set->rule_count = rule_count;
+    set->first_state_rule = (uint32_t *)arena_allocate(arena, sizeof(uint32_t) * (automaton->state_count + 1));
+    set->state_rules = (uint32_t *)arena_allocate(arena, sizeof(uint32_t) * (rule_count * 2 + 1));
+    uint32_t *first_state_rule = set->first_state_rule;
+    uint32_t *rule_states = set->state_rules + rule_count;
+    memset(first_state_rule, 0, sizeof(uint32_t) * (automaton->state_count + 1));
+    for (size_t i = 0; i < rule_count; i++)
+    {
+        const ReplaceRule *rule = &rules[rule_indices[i]];
+        int32_t state = 0;
+        for (size_t n = 0; n < rule->target_length; n++)
+        {
+            state = automaton->transitions[state * IDENTIFIER_CHAR_CLASS_COUNT + identifier_char_class(rule->target[n])];
+        }
+        rule_states[i] = (uint32_t)state;
+        first_state_rule[state + 1]++;
+    }
+    for (size_t i = 0; i < automaton->state_count; i++) first_state_rule[i + 1] += first_state_rule[i];
+    for (size_t i = 0; i < rule_count; i++) set->state_rules[first_state_rule[rule_states[i]]++] = rule_indices[i];
+    for (size_t i = automaton->state_count; i > 0; i--) first_state_rule[i] = first_state_rule[i - 1];
+    first_state_rule[0] = 0;
+}
+
+//The operator has to be in the same segment as the target
+static bool find_member_operator(const char *cursor, const char *end, ReplaceKind kind,
+    const char **operator_begin, const char **operator_end)
+{
+    while (cursor < end && (*cursor == ' ' || *cursor == '\t')) cursor++;
+    if (kind == ReplaceKind_TO_POINTER && cursor < end && *cursor == '.' &&
+        (cursor + 1 >= end || cursor[1] != '.'))
+    {
+        *operator_begin = cursor;
+        *operator_end = cursor + 1;
+        return true;
+    }
+    if (kind == ReplaceKind_TO_VALUE && cursor + 1 < end && cursor[0] == '-' && cursor[1] == '>')
+    {
+        *operator_begin = cursor;
+        *operator_end = cursor + 2;
+        return true;
+    }
+    return false;
+}
+
+static int compare_replace_matches(const void *a, const void *b)
+{
+    const ReplaceMatch *match_a = (const ReplaceMatch *)a;
+    const ReplaceMatch *match_b = (const ReplaceMatch *)b;
+    if (match_a->occurrence != match_b->occurrence) return match_a->occurrence < match_b->occurrence ? -1 : 1;
+    if (match_a->offset != match_b->offset) return match_a->offset < match_b->offset ? -1 : 1;
+    return 0;
+}
+
+static int compare_rule_hits(const void *a, const void *b)
+{
+    const ReplaceMatch *match_a = (const ReplaceMatch *)a;
+    const ReplaceMatch *match_b = (const ReplaceMatch *)b;
+    if (match_a->occurrence != match_b->occurrence) return match_a->occurrence < match_b->occurrence ? -1 : 1;
+    if (match_a->offset != match_b->offset) return match_a->offset < match_b->offset ? -1 : 1;
+    if (match_a->length != match_b->length) return match_a->length > match_b->length ? -1 : 1;
+    if (match_a->priority != match_b->priority) return match_a->priority < match_b->priority ? -1 : 1;
+    return 0;
+}
+
+#define REPLACE_SCOPE_UNKNOWN 0xFFFFFFFEu
+
+//When two active rules share a target the innermost scope wins, then the
+//one declared first
+typedef struct {
+    uint32_t *order;               //Outer scopes before the scopes they contain
+    uint32_t *parent;
+    uint32_t *rule_priority;       //Lower wins
+    uint32_t *brace_scope_map;     //Innermost replace scope of each brace scope
+} ReplaceScopeTree;
+
+static void build_replace_scope_tree(EditState *edit, ReplaceScopeTree *tree)
+{
+    size_t scope_count = edit->replace_scope_count;
+    size_t rule_count = edit->replace_rule_count;
+    const ReplaceScope *scopes = edit->replace_scopes;
+    tree->order = (uint32_t *)arena_allocate(&edit->arena, sizeof(uint32_t) * (scope_count * 4 + rule_count + 2));
+    tree->parent = tree->order + scope_count;
+    uint32_t *stack = tree->parent + scope_count;
+    uint32_t *depth = stack + scope_count;
+    tree->rule_priority = depth + scope_count;
+    tree->brace_scope_map = (uint32_t *)arena_allocate(&edit->arena, sizeof(uint32_t) * (edit->scope_count + 1));
+    for (size_t i = 0; i < edit->scope_count; i++) tree->brace_scope_map[i] = REPLACE_SCOPE_UNKNOWN;
+
+    for (uint32_t i = 0; i < scope_count; i++)
+    {
+        uint32_t n = i;
+        while (n > 0 && (scopes[tree->order[n - 1]].begin > scopes[i].begin ||
+            (scopes[tree->order[n - 1]].begin == scopes[i].begin && scopes[tree->order[n - 1]].end < scopes[i].end)))
+        {
+            tree->order[n] = tree->order[n - 1];
+            n--;
+        }
+        tree->order[n] = i;
+    }
+
+    size_t stack_count = 0;
+    uint32_t max_depth = 0;
+    for (size_t i = 0; i < scope_count; i++)
+    {
+        uint32_t scope = tree->order[i];
+        while (stack_count > 0 && scopes[stack[stack_count - 1]].end < scopes[scope].end) stack_count--;
+        tree->parent[scope] = stack_count > 0 ? stack[stack_count - 1] : SCOPE_NONE;
+        depth[scope] = (uint32_t)stack_count;
+        if (depth[scope] > max_depth) max_depth = depth[scope];
+        stack[stack_count++] = scope;
+    }
+
+    uint32_t *first_priority = (uint32_t *)arena_allocate(&edit->arena, sizeof(uint32_t) * (max_depth + 2));
+    memset(first_priority, 0, sizeof(uint32_t) * (max_depth + 2));
+    for (size_t i = 0; i < rule_count; i++) first_priority[max_depth - depth[edit->replace_rules[i].scope_index] + 1]++;
+    for (size_t i = 0; i <= max_depth; i++) first_priority[i + 1] += first_priority[i];
+    for (size_t i = 0; i < rule_count; i++)
+    {
+        tree->rule_priority[i] = first_priority[max_depth - depth[edit->replace_rules[i].scope_index]]++;
+    }
+}
+
+//The last scope to start at or before position either holds it or sits
+//inside of every scope that does
+static uint32_t find_replace_scope(const EditState *edit, const ReplaceScopeTree *tree,
+    const char *position, const char **next_begin)
+{
+    const ReplaceScope *scopes = edit->replace_scopes;
+    size_t low = 0, high = edit->replace_scope_count;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (scopes[tree->order[middle]].begin <= position) low = middle + 1;
+        else high = middle;
+    }
+    *next_begin = low < edit->replace_scope_count ? scopes[tree->order[low]].begin : NULL;
+    if (low == 0) return SCOPE_NONE;
+
+    uint32_t scope = tree->order[low - 1];
+    while (scope != SCOPE_NONE && scopes[scope].end <= position) scope = tree->parent[scope];
+    return scope;
+}
+
+//Every replace scope is a brace scope or starts at file scope, so the text
+//directly inside one brace scope shares the same innermost replace scope
+static uint32_t get_brace_replace_scope(const EditState *edit, ReplaceScopeTree *tree, uint32_t brace_scope)
+{
+    uint32_t *mapped = &tree->brace_scope_map[brace_scope];
+    if (*mapped == REPLACE_SCOPE_UNKNOWN)
+    {
+        const char *next_begin;
+        *mapped = find_replace_scope(edit, tree, edit->scopes[brace_scope].begin, &next_begin);
+    }
+    return *mapped;
+}
+
+//=========================================================
+// Identifier table
+//=========================================================
+
+
+#define NAME_NONE 0xFFFFFFFFu
+
+typedef struct {
+    const char *text;              //Copied out so names sit close together
+    uint32_t length;
+    uint32_t first_occurrence;     //Into occurrence_order
+    uint32_t occurrence_count;
+} IdentifierName;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t name;
+} NameSlot;
+
+//Identifiers of generated text count as being where its edit is
+typedef struct {
+    const char *begin;
+    const char *end;
+    const char *position;          //NULL for original text
+    uint32_t first_occurrence;
+} TextSegment;
+
+typedef struct {
+    IdentifierName *names;
+    size_t name_count;
+    size_t name_capacity;
+    NameSlot *name_slots;          //Open addressed on the hash of the name
+    size_t slot_capacity;
+
+    //Parallel arrays, the binary search over positions only touches positions
+    const char *base;              //Positions are offsets from here
+    uint32_t *occurrence_names;
+    uint32_t *occurrence_positions;    //Where it sits in the file, see TextSegment
+    uint32_t *occurrence_offsets;      //Of its text from the begin of its segment
+    size_t occurrence_count;
+    size_t occurrence_capacity;
+    uint32_t *occurrence_order;    //Occurrences grouped by name, in output order within each name
+
+    TextSegment *segments;
+    size_t segment_count;
+    size_t segment_capacity;
+} IdentifierTable;
+
+static inline uint64_t hash_identifier_64(const char *text, size_t length)
+{
+    uint64_t hash = length * 0x9E3779B97F4A7C15ull;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, text, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+        text += 8;
+        length -= 8;
+    }
+    //The length is already in the hash so overlapping tail loads can't collide
+    if (length > 0)
+    {
+        uint64_t word;
+        if (length >= 4)
+        {
+            uint32_t head, tail;
+            memcpy(&head, text, 4);
+            memcpy(&tail, text + length - 4, 4);
+            word = ((uint64_t)head << 32) | tail;
+        }
+        else
+        {
+            word = (uint64_t)(uint8_t)text[0] | (uint64_t)(uint8_t)text[length / 2] << 8 |
+                (uint64_t)(uint8_t)text[length - 1] << 16;
+        }
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static inline uint32_t hash_identifier(const char *text, size_t length)
+{
+    return (uint32_t)hash_identifier_64(text, length);
+}
+
+static inline size_t find_name_slot(const IdentifierTable *table, const char *text, size_t length, uint32_t hash)
+{
+    size_t mask = table->slot_capacity - 1;
+    size_t slot = hash & mask;
+    while (table->name_slots[slot].name != NAME_NONE)
+    {
+        if (table->name_slots[slot].hash == hash)
+        {
+            const IdentifierName *name = &table->names[table->name_slots[slot].name];
+            if (name->length == length && memcmp(name->text, text, length) == 0) break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static uint32_t find_identifier(const IdentifierTable *table, const char *text, size_t length)
+{
+    if (table->slot_capacity == 0) return NAME_NONE;
+    return table->name_slots[find_name_slot(table, text, length, hash_identifier(text, length))].name;
+}
+
+static uint32_t intern_identifier(MemoryArena *arena, IdentifierTable *table, const char *text, size_t length)
+{
+    if ((table->name_count + 1) * 2 > table->slot_capacity)
+    {
+        NameSlot *old_slots = table->name_slots;
+        size_t old_capacity = table->slot_capacity;
+        table->slot_capacity = old_capacity ? old_capacity * 2 : 1024;
+        table->name_slots = (NameSlot *)arena_allocate(arena, sizeof(NameSlot) * table->slot_capacity);
+        memset(table->name_slots, 0xFF, sizeof(NameSlot) * table->slot_capacity);
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i].name == NAME_NONE) continue;
+            size_t slot = old_slots[i].hash & (table->slot_capacity - 1);
+            while (table->name_slots[slot].name != NAME_NONE) slot = (slot + 1) & (table->slot_capacity - 1);
+            table->name_slots[slot] = old_slots[i];
+        }
+    }
+
+    uint32_t hash = hash_identifier(text, length);
+    size_t slot = find_name_slot(table, text, length, hash);
+    if (table->name_slots[slot].name == NAME_NONE)
+    {
+        table->name_slots[slot].hash = hash;
+        table->name_slots[slot].name = (uint32_t)table->name_count;
+        char *copy = (char *)arena_allocate(arena, length);
+        memcpy(copy, text, length);
+        IdentifierName *name = push_array_element(arena, table->names, table->name_count, table->name_capacity);
+        name->text = copy;
+        name->length = (uint32_t)length;
+        name->first_occurrence = 0;
+        name->occurrence_count = 0;
+    }
+    return table->name_slots[slot].name;
+}
+
+static void push_occurrence(MemoryArena *arena, IdentifierTable *table,
+    uint32_t name, uint32_t position, uint32_t offset)
+{
+    //One block for all three, only the last allocation of an arena grows in place
+    if (table->occurrence_count == table->occurrence_capacity)
+    {
+        size_t old_capacity = table->occurrence_capacity;
+        size_t new_capacity = old_capacity ? old_capacity * 2 : 1024;
+        uint32_t *block = (uint32_t *)arena_resize(arena, table->occurrence_names,
+            3 * sizeof(uint32_t) * old_capacity, 3 * sizeof(uint32_t) * new_capacity);
+        memmove(block + 2 * new_capacity, block + 2 * old_capacity, sizeof(uint32_t) * old_capacity);
+        memmove(block + new_capacity, block + old_capacity, sizeof(uint32_t) * old_capacity);
+        table->occurrence_names = block;
+        table->occurrence_positions = block + new_capacity;
+        table->occurrence_offsets = block + 2 * new_capacity;
+        table->occurrence_capacity = new_capacity;
+    }
+    table->occurrence_names[table->occurrence_count] = name;
+    table->occurrence_positions[table->occurrence_count] = position;
+    table->occurrence_offsets[table->occurrence_count] = offset;
+    table->occurrence_count++;
+}
+
+static void push_text_segment(EditState *edit, IdentifierTable *table,
+    const char *begin, const char *end, const char *position)
+{
+    if (begin == end) return;
+    TextSegment *segment = push_array_element(&edit->arena, table->segments, table->segment_count, table->segment_capacity);
+    segment->begin = begin;
+    segment->end = end;
+    segment->position = position;
+    segment->first_occurrence = 0;
+}
+
+static void build_text_segments(Lexer *lex, EditState *edit, IdentifierTable *table)
+{
+    const char *cursor = lex->buffer;
+    for (size_t i = 0; i < edit->source_edit_count; i++)
+    {
+        const SourceEdit *source_edit = &edit->source_edits[i];
+        push_text_segment(edit, table, cursor, source_edit->begin, NULL);
+        push_text_segment(edit, table, source_edit->text, source_edit->text + source_edit->length, source_edit->begin);
+        cursor = source_edit->end;
+    }
+    push_text_segment(edit, table, cursor, lex->buffer + lex->buffer_size, NULL);
+}
+
+//Once a position is outside of every replace scope so is everything up to
+//where the next one starts
+static void build_identifier_table(EditState *edit, IdentifierTable *table,
+    ReplaceScopeTree *tree, size_t min_length)
+{
+    uint32_t next_scope = 0;
+    uint32_t current_scope = SCOPE_NONE;
+    uint32_t file_replace_scope = SCOPE_NONE;
+    const char *next_replace_scope_begin = NULL;
+    bool file_replace_scope_known = false;
+    const char *covered_from = NULL;
+    bool is_past_last_scope = false;
+    for (size_t i = 0; i < table->segment_count; i++)
+    {
+        TextSegment *segment = &table->segments[i];
+        segment->first_occurrence = (uint32_t)table->occurrence_count;
+        if (is_past_last_scope) continue;
+
+        const char *cursor = segment->begin;
+        if (covered_from != NULL)
+        {
+            if (segment->position != NULL && segment->position < covered_from) continue;
+            if (segment->position == NULL && cursor < covered_from)
+            {
+                cursor = covered_from < segment->end ? covered_from : segment->end;
+            }
+        }
+
+        while (cursor < segment->end)
+        {
+            const char *run_begin = find_identifier_char(cursor, segment->end);
+            const char *run_end = skip_identifier_chars(run_begin, segment->end);
+            cursor = run_end;
+            if ((size_t)(run_end - run_begin) < min_length) continue;
+
+            const char *position = segment->position ? segment->position : run_begin;
+            while (next_scope < edit->scope_count && edit->scopes[next_scope].begin <= position)
+            {
+                current_scope = next_scope++;
+            }
+            while (current_scope != SCOPE_NONE && edit->scopes[current_scope].end <= position)
+            {
+                current_scope = edit->scopes[current_scope].parent;
+            }
+
+            uint32_t replace_scope;
+            if (current_scope != SCOPE_NONE)
+            {
+                replace_scope = get_brace_replace_scope(edit, tree, current_scope);
+            }
+            else
+            {
+                if (!file_replace_scope_known ||
+                    (next_replace_scope_begin != NULL && position >= next_replace_scope_begin))
+                {
+                    file_replace_scope = find_replace_scope(edit, tree, position, &next_replace_scope_begin);
+                    file_replace_scope_known = true;
+                }
+                replace_scope = file_replace_scope;
+            }
+            if (replace_scope == SCOPE_NONE)
+            {
+                find_replace_scope(edit, tree, position, &covered_from);
+                if (covered_from == NULL)
+                {
+                    is_past_last_scope = true;
+                    break;
+                }
+                if (segment->position != NULL) break;
+                if (cursor < covered_from) cursor = covered_from < segment->end ? covered_from : segment->end;
+                continue;
+            }
+
+            uint32_t name = intern_identifier(&edit->arena, table, run_begin, run_end - run_begin);
+            table->names[name].occurrence_count++;
+            push_occurrence(&edit->arena, table, name, (uint32_t)(position - table->base),
+                (uint32_t)(run_begin - segment->begin));
+        }
+    }
+
+    uint32_t first = 0;
+    for (size_t i = 0; i < table->name_count; i++)
+    {
+        table->names[i].first_occurrence = first;
+        first += table->names[i].occurrence_count;
+        table->names[i].occurrence_count = 0;
+    }
+
+    table->occurrence_order = (uint32_t *)arena_allocate(&edit->arena, sizeof(uint32_t) * (table->occurrence_count + 1));
+    for (size_t i = 0; i < table->occurrence_count; i++)
+    {
+        IdentifierName *name = &table->names[table->occurrence_names[i]];
+        table->occurrence_order[name->first_occurrence + name->occurrence_count++] = (uint32_t)i;
+    }
+}
+
+static const TextSegment *find_occurrence_segment(const IdentifierTable *table, uint32_t occurrence)
+{
+    size_t low = 0, high = table->segment_count;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (table->segments[middle].first_occurrence <= occurrence) low = middle + 1;
+        else high = middle;
+    }
+    return &table->segments[low - 1];
+}
+
+//The occurrences of a name are in file order, the ones in scope are one stretch
+static void push_rule_hits(EditState *edit, const IdentifierTable *table, const ReplaceScopeTree *tree,
+    uint32_t name_index, uint32_t rule_index, size_t offset, size_t length)
+{
+    const IdentifierName *name = &table->names[name_index];
+    const ReplaceScope *scope = &edit->replace_scopes[edit->replace_rules[rule_index].scope_index];
+    const uint32_t *occurrences = table->occurrence_order + name->first_occurrence;
+    uint32_t scope_begin = (uint32_t)(scope->begin - table->base);
+    uint32_t scope_end = (uint32_t)(scope->end - table->base);
+    size_t low = 0, high = name->occurrence_count;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (table->occurrence_positions[occurrences[middle]] < scope_begin) low = middle + 1;
+        else high = middle;
+    }
+
+    for (size_t n = low; n < name->occurrence_count; n++)
+    {
+        if (table->occurrence_positions[occurrences[n]] >= scope_end) break;
+        ReplaceMatch *match = push_array_element(&edit->arena, edit->replace_matches, edit->replace_match_count, edit->replace_match_capacity);
+        match->offset = (uint32_t)offset;
+        match->length = (uint32_t)length;
+        match->rule_index = rule_index;
+        match->occurrence = occurrences[n];
+        match->priority = tree->rule_priority[rule_index];
+    }
+}
+
+static void find_replace_matches(EditState *edit, IdentifierTable *table, const ReplaceScopeTree *tree)
+{
+    const ReplaceRule *rules = edit->replace_rules;
+    uint32_t *rule_indices = (uint32_t *)arena_allocate(&edit->arena, sizeof(uint32_t) * (edit->replace_rule_count + 1));
+    size_t text_rule_count = 0;
+    for (size_t i = 0; i < edit->replace_rule_count; i++)
+    {
+        if (rules[i].kind == ReplaceKind_TEXT || rules[i].kind == ReplaceKind_WORD) rule_indices[text_rule_count++] = (uint32_t)i;
+    }
+
+    if (text_rule_count > 0)
+    {
+        ReplaceRuleSet built_set;
+        const ReplaceRuleSet *set = edit->plan_rule_set;
+        if (set == NULL || set->rule_count != text_rule_count)
+        {
+            build_replace_rule_set(&edit->arena, &built_set, rules, rule_indices, text_rule_count);
+            set = &built_set;
+        }
+        const ReplaceAutomaton *automaton = &set->automaton;
+        const uint32_t *first_state_rule = set->first_state_rule;
+        const uint32_t *state_rules = set->state_rules;
+
+        for (uint32_t i = 0; i < table->name_count; i++)
+        {
+            const IdentifierName *name = &table->names[i];
+            int32_t state = 0;
+            for (size_t n = 0; n < name->length; n++)
+            {
+                state = automaton->transitions[state * IDENTIFIER_CHAR_CLASS_COUNT + identifier_char_class(name->text[n])];
+                int32_t output = automaton->rule_index[state] != -1 ? state : automaton->output_link[state];
+                for (; output != -1; output = automaton->output_link[output])
+                {
+                    size_t target_length = rules[automaton->rule_index[output]].target_length;
+                    for (uint32_t r = first_state_rule[output]; r < first_state_rule[output + 1]; r++)
+                    {
+                        push_rule_hits(edit, table, tree, i, state_rules[r], n + 1 - target_length, target_length);
+                    }
+                }
+            }
+        }
+    }
+
+    //A #rw that wins a target but doesn't cover the whole name still hides
+    //the rules below it
+    ReplaceMatch *matches = edit->replace_matches;
+    qsort(matches, edit->replace_match_count, sizeof(ReplaceMatch), compare_rule_hits);
+    size_t kept_count = 0;
+    uint32_t occurrence_index = NAME_NONE;
+    uint32_t matched_end = 0;
+    uint32_t hit_offset = 0, hit_length = 0;
+    for (size_t i = 0; i < edit->replace_match_count; i++)
+    {
+        ReplaceMatch match = matches[i];
+        if (match.occurrence != occurrence_index)
+        {
+            occurrence_index = match.occurrence;
+            matched_end = 0;
+        }
+        else if (match.offset == hit_offset && match.length == hit_length)
+        {
+            continue;
+        }
+        hit_offset = match.offset;
+        hit_length = match.length;
+
+        if (rules[match.rule_index].kind == ReplaceKind_WORD &&
+            (match.offset != 0 || match.length != table->names[table->occurrence_names[match.occurrence]].length))
+        {
+            continue;
+        }
+        if (match.offset < matched_end) continue;
+        matched_end = match.offset + match.length;
+        matches[kept_count++] = match;
+    }
+    edit->replace_match_count = kept_count;
+
+    //The innermost #ptr / #val decides, even where that turns out to be nothing
+    size_t first_operator_hit = edit->replace_match_count;
+    for (uint32_t i = 0; i < edit->replace_rule_count; i++)
+    {
+        if (rules[i].kind != ReplaceKind_TO_POINTER && rules[i].kind != ReplaceKind_TO_VALUE) continue;
+        uint32_t name = find_identifier(table, rules[i].target, rules[i].target_length);
+        if (name != NAME_NONE) push_rule_hits(edit, table, tree, name, i, rules[i].target_length, 0);
+    }
+
+    matches = edit->replace_matches;
+    size_t operator_hit_count = edit->replace_match_count - first_operator_hit;
+    qsort(matches + first_operator_hit, operator_hit_count, sizeof(ReplaceMatch), compare_rule_hits);
+    kept_count = first_operator_hit;
+    occurrence_index = NAME_NONE;
+    for (size_t i = first_operator_hit; i < edit->replace_match_count; i++)
+    {
+        ReplaceMatch match = matches[i];
+        if (match.occurrence == occurrence_index) continue;
+        occurrence_index = match.occurrence;
+
+        const TextSegment *segment = find_occurrence_segment(table, match.occurrence);
+        const char *text = segment->begin + table->occurrence_offsets[match.occurrence];
+        const char *operator_begin, *operator_end;
+        if (find_member_operator(text + match.offset, segment->end,
+            rules[match.rule_index].kind, &operator_begin, &operator_end))
+        {
+            match.offset = (uint32_t)(operator_begin - text);
+            match.length = (uint32_t)(operator_end - operator_begin);
+            matches[kept_count++] = match;
+        }
+    }
+    edit->replace_match_count = kept_count;
+
+    if (kept_count > first_operator_hit)
+    {
+        qsort(matches, edit->replace_match_count, sizeof(ReplaceMatch), compare_replace_matches);
+    }
+}
+
+static void resolve_edit_pieces(Lexer *lex, EditState *edit)
+{
+    IdentifierTable table = {};
+    table.base = lex->buffer;
+    build_text_segments(lex, edit, &table);
+    if (edit->replace_rule_count == 0)
+    {
+        for (size_t i = 0; i < table.segment_count; i++)
+        {
+            push_edit_piece(edit, table.segments[i].begin, table.segments[i].end - table.segments[i].begin);
+        }
+        return;
+    }
+
+    //The identifier table keeps 32 bit positions
+    if (lex->buffer_size > UINT32_MAX)
+    {
+        report_error_and_exit(lex, "Identifier procedures are not supported in files of 4GB or more");
+    }
+
+    size_t min_target_length = (size_t)-1;
+    for (size_t i = 0; i < edit->replace_rule_count; i++)
+    {
+        if (edit->replace_rules[i].target_length < min_target_length)
+            min_target_length = edit->replace_rules[i].target_length;
+    }
+
+    ReplaceScopeTree tree;
+    build_replace_scope_tree(edit, &tree);
+    build_identifier_table(edit, &table, &tree, min_target_length);
+    edit->replace_match_count = 0;
+    find_replace_matches(edit, &table, &tree);
+
+    const ReplaceMatch *matches = edit->replace_matches;
+    size_t match_index = 0;
+    for (size_t i = 0; i < table.segment_count; i++)
+    {
+        const TextSegment *segment = &table.segments[i];
+        uint32_t end_occurrence = i + 1 < table.segment_count ?
+            table.segments[i + 1].first_occurrence : (uint32_t)table.occurrence_count;
+
+        const char *emitted = segment->begin;
+        for (; match_index < edit->replace_match_count && matches[match_index].occurrence < end_occurrence; match_index++)
+        {
+            const ReplaceMatch *match = &matches[match_index];
+            const ReplaceRule *rule = &edit->replace_rules[match->rule_index];
+            const char *match_begin = segment->begin + table.occurrence_offsets[match->occurrence] + match->offset;
+            push_edit_piece(edit, emitted, match_begin - emitted);
+            if (rule->kind == ReplaceKind_TO_POINTER) push_edit_piece(edit, "->", 2);
+            else if (rule->kind == ReplaceKind_TO_VALUE) push_edit_piece(edit, ".", 1);
+            else push_edit_piece(edit, rule->replacement, rule->replacement_length);
+            emitted = match_begin + match->length;
+        }
+        push_edit_piece(edit, emitted, segment->end - emitted);
+    }
+}
+
+static bool write_edit_pieces(int fd, const EditPiece *pieces, size_t piece_count)
+{
+    struct iovec iov[IOV_MAX];
+    size_t piece_index = 0;
+    size_t piece_offset = 0;
+    while (piece_index < piece_count)
+    {
+        int iov_count = 0;
+        size_t batch_offset = piece_offset;
+        for (size_t i = piece_index; i < piece_count && iov_count < IOV_MAX; i++)
+        {
+            iov[iov_count].iov_base = (void *)(pieces[i].text + batch_offset);
+            iov[iov_count].iov_len = pieces[i].length - batch_offset;
+            batch_offset = 0;
+            iov_count++;
+        }
+
+        ssize_t written = writev(fd, iov, iov_count);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        //writev makes no progress on empty pieces
+        size_t remaining = (size_t)written;
+        while (piece_index < piece_count)
+        {
+            size_t piece_remaining = pieces[piece_index].length - piece_offset;
+            if (remaining < piece_remaining)
+            {
+                piece_offset += remaining;
+                break;
+            }
+            remaining -= piece_remaining;
+            piece_index++;
+            piece_offset = 0;
+        }
+    }
+    return true;
+}
+
+//An atomic write always makes a new inode, so a rename changes this even
+//when the size and modification time happen to match
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+} FileSignature;
+
+static inline FileSignature get_file_signature(const struct stat *st)
+{
+    FileSignature result;
+    result.device = st->st_dev;
+    result.inode = st->st_ino;
+    result.size = st->st_size;
+    result.modified = st->st_mtim;
+    return result;
+}
+
+static inline bool signatures_match(const FileSignature *a, const FileSignature *b)
+{
+    return a->device == b->device && a->inode == b->inode && a->size == b->size &&
+        a->modified.tv_sec == b->modified.tv_sec && a->modified.tv_nsec == b->modified.tv_nsec;
+}
+
+//The lexer needs a null at buffer[size].  The kernel zero fills the tail of
+//the last page, unless the file ends exactly on a page boundary
+typedef struct {
+    const char *data;
+    size_t size;
+    mode_t mode;
+    bool is_mapped;
+    FileSignature signature;
+} MappedFile;
+
+static bool map_file(const char *filename, MappedFile *file)
+{
+    memset(file, 0, sizeof(MappedFile));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+
+    file->size = (size_t)st.st_size;
+    file->mode = st.st_mode & 07777;
+    file->signature = get_file_signature(&st);
+
+    static long page_size = sysconf(_SC_PAGESIZE);
+    if (file->size == 0)
+    {
+        file->data = "";
+    }
+    else if (file->size % page_size != 0)
+    {
+        void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            file->data = (const char *)data;
+            file->is_mapped = true;
+        }
+    }
+
+    if (file->data == NULL)
+    {
+        char *buffer = (char *)malloc(file->size + 1);
+        size_t read_size = 0;
+        while (read_size < file->size)
+        {
+            ssize_t count = read(fd, buffer + read_size, file->size - read_size);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) break;
+            read_size += count;
+        }
+
+        if (read_size != file->size)
+        {
+            free(buffer);
+            close(fd);
+            return false;
+        }
+        buffer[file->size] = 0;
+        file->data = buffer;
+    }
+
+    close(fd);
+    return true;
+}
+
+static void unmap_file(MappedFile *file)
+{
+    if (file->is_mapped)
+    {
+        munmap((void *)file->data, file->size);
+    }
+    else if (file->size > 0)
+    {
+        free((void *)file->data);
+    }
+    file->data = NULL;
+}
+
+//The rename itself is only on disk once the directory holding it is
+static bool sync_parent_directory(const char *path)
+{
+    char directory[PATH_MAX];
+    const char *basename = strrchr(path, '/');
+    if (basename == NULL) snprintf(directory, sizeof(directory), ".");
+    else if (basename == path) snprintf(directory, sizeof(directory), "/");
+    else snprintf(directory, sizeof(directory), "%.*s", (int)(basename - path), path);
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return false;
+    bool success = fsync(fd) == 0;
+    return close(fd) == 0 && success;
+}
+
+typedef struct {
+    char target[PATH_MAX];
+    char temp_path[PATH_MAX];
+} StagedFile;
+
+static bool stage_file(const char *filename, mode_t mode,
+    const EditPiece *pieces, size_t piece_count, FileSignature *written, StagedFile *staged)
+{
+    char *target = staged->target;
+    if (realpath(filename, target) == NULL)
+    {
+        snprintf(target, PATH_MAX, "%s", filename);
+    }
+
+    char *temp_path = staged->temp_path;
+    const char *basename = strrchr(target, '/');
+    int temp_length;
+    if (basename == NULL)
+    {
+        temp_length = snprintf(temp_path, PATH_MAX, ".%s.ductus.XXXXXX", target);
+    }
+    else
+    {
+        temp_length = snprintf(temp_path, PATH_MAX, "%.*s/.%s.ductus.XXXXXX",
+            (int)(basename - target), target, basename + 1);
+    }
+    if (temp_length < 0 || temp_length >= PATH_MAX) return false;
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0) return false;
+
+    //The owner goes before the mode, a chown clears setuid and setgid bits
+    struct stat original;
+    bool keeps_owner = stat(target, &original) != 0 ||
+        fchown(fd, original.st_uid, original.st_gid) == 0 || errno == EPERM;
+
+    struct stat st;
+    bool success = keeps_owner && write_edit_pieces(fd, pieces, piece_count) &&
+        fchmod(fd, mode) == 0 && fdatasync(fd) == 0 && fstat(fd, &st) == 0;
+    if (success && written != NULL)
+    {
+        *written = get_file_signature(&st);
+    }
+    success = (close(fd) == 0) && success;
+    if (!success)
+    {
+        unlink(temp_path);
+    }
+    return success;
+}
+
+static bool commit_staged_file(const char *temp_path, const char *target)
+{
+    if (rename(temp_path, target) != 0)
+    {
+        unlink(temp_path);
+        return false;
+    }
+    return sync_parent_directory(target);
+}
+
+static bool write_file_atomic(const char *filename, mode_t mode,
+    const EditPiece *pieces, size_t piece_count, FileSignature *written)
+{
+    StagedFile staged;
+    return stage_file(filename, mode, pieces, piece_count, written, &staged) &&
+        commit_staged_file(staged.temp_path, staged.target);
+}
+
+//A piece that points back into the original from elsewhere, like the text
+//of a #r, only makes the edits less tight
+typedef struct {
+    size_t offset;
+    size_t removed_length;
+    size_t inserted_length;
+    size_t first_piece;            //The inserted text is pieces first_piece to end_piece
+    size_t end_piece;
+} PieceEdit;
+
+static size_t find_piece_edits(MemoryArena *arena, const char *data, size_t size,
+    const EditPiece *pieces, size_t piece_count, PieceEdit **result)
+{
+    PieceEdit *edits = NULL;
+    size_t edit_count = 0, edit_capacity = 0;
+    const char *original_end = data + size;
+    const char *kept_end = data;
+    size_t first_inserted = 0;
+    size_t inserted_length = 0;
+    for (size_t i = 0; i <= piece_count; i++)
+    {
+        bool is_end = i == piece_count;
+        if (!is_end && !(pieces[i].text >= kept_end && pieces[i].text + pieces[i].length <= original_end))
+        {
+            inserted_length += pieces[i].length;
+            continue;
+        }
+
+        const char *kept_begin = is_end ? original_end : pieces[i].text;
+        if (kept_begin > kept_end || inserted_length > 0)
+        {
+            PieceEdit *edit = push_array_element(arena, edits, edit_count, edit_capacity);
+            edit->offset = kept_end - data;
+            edit->removed_length = kept_begin - kept_end;
+            edit->inserted_length = inserted_length;
+            edit->first_piece = first_inserted;
+            edit->end_piece = i;
+        }
+        if (!is_end) kept_end = pieces[i].text + pieces[i].length;
+        first_inserted = i + 1;
+        inserted_length = 0;
+    }
+    *result = edits;
+    return edit_count;
+}
+
+//=========================================================
+// Undo journal
+//=========================================================
+
+//"applied" holds how many journals are applied, a new run drops the
+//journals that were undone past that
+
+#define JOURNAL_DIRECTORY ".ductus_journal"
+#define JOURNAL_RUN_LIMIT 64
+#define JOURNAL_MAGIC "DUCTUSJ1"
+#define JOURNAL_MAGIC_SIZE 8
+
+typedef struct {
+    uint32_t path_length;
+    uint32_t edit_count;
+    uint64_t edits_size;           //Bytes of edits and their text after the path
+    FileSignature signature;       //The file as the journal last left it
+} JournalEntry;
+
+typedef struct {
+    uint64_t offset;               //Into the file before the run
+    uint32_t removed_length;
+    uint32_t inserted_length;
+} JournalEdit;
+
+typedef struct {
+    int fd;
+    uint64_t run_index;
+    size_t entry_count;
+    pthread_mutex_t mutex;
+} Journal;
+
+static void get_journal_path(char *path, size_t capacity, uint64_t run_index)
+{
+    snprintf(path, capacity, "%s/%llu.journal", JOURNAL_DIRECTORY, (unsigned long long)run_index);
+}
+
+static uint64_t read_applied_run_count()
+{
+    FILE *file = fopen(JOURNAL_DIRECTORY "/applied", "r");
+    if (file == NULL) return 0;
+    unsigned long long count = 0;
+    if (fscanf(file, "%llu", &count) != 1) count = 0;
+    fclose(file);
+    return count;
+}
+
+static bool write_applied_run_count(uint64_t count)
+{
+    char text[32];
+    EditPiece piece;
+    piece.text = text;
+    piece.length = (size_t)snprintf(text, sizeof(text), "%llu\n", (unsigned long long)count);
+    return write_file_atomic(JOURNAL_DIRECTORY "/applied", 0644, &piece, 1, NULL);
+}
+
+static bool begin_journal(Journal *journal)
+{
+    memset(journal, 0, sizeof(Journal));
+    if (mkdir(JOURNAL_DIRECTORY, 0755) != 0 && errno != EEXIST) return false;
+
+    char path[PATH_MAX];
+    uint64_t applied_count = read_applied_run_count();
+    for (uint64_t i = applied_count + 1; ; i++)
+    {
+        get_journal_path(path, sizeof(path), i);
+        if (unlink(path) != 0) break;
+    }
+
+    journal->run_index = applied_count + 1;
+    get_journal_path(path, sizeof(path), journal->run_index);
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (journal->fd < 0) return false;
+
+    EditPiece magic;
+    magic.text = JOURNAL_MAGIC;
+    magic.length = JOURNAL_MAGIC_SIZE;
+    if (!write_edit_pieces(journal->fd, &magic, 1))
+    {
+        close(journal->fd);
+        unlink(path);
+        return false;
+    }
+    pthread_mutex_init(&journal->mutex, NULL);
+    return true;
+}
+
+//A run that changed nothing leaves no journal, so --undo always goes back
+//to the last run that did something
+static void end_journal(Journal *journal)
+{
+    char path[PATH_MAX];
+    get_journal_path(path, sizeof(path), journal->run_index);
+    bool success = fdatasync(journal->fd) == 0;
+    success = close(journal->fd) == 0 && success;
+    pthread_mutex_destroy(&journal->mutex);
+    if (journal->entry_count == 0)
+    {
+        unlink(path);
+        return;
+    }
+
+    if (!success || !write_applied_run_count(journal->run_index))
+    {
+        fprintf(stderr, "Could not finish the undo journal %s\n", path);
+        return;
+    }
+
+    //Only a history left by a build with a larger limit goes further back
+    for (uint64_t i = journal->run_index; i > JOURNAL_RUN_LIMIT; i--)
+    {
+        get_journal_path(path, sizeof(path), i - JOURNAL_RUN_LIMIT);
+        if (unlink(path) != 0) break;
+    }
+}
+
+static bool record_journal_entry(Journal *journal, MemoryArena *arena, const char *filename,
+    const MappedFile *file, const EditPiece *pieces, size_t piece_count, const FileSignature *signature)
+{
+    PieceEdit *edits;
+    size_t edit_count = find_piece_edits(arena, file->data, file->size, pieces, piece_count, &edits);
+
+    char path[PATH_MAX];
+    if (realpath(filename, path) == NULL) snprintf(path, sizeof(path), "%s", filename);
+
+    JournalEntry entry;
+    memset(&entry, 0, sizeof(JournalEntry));
+    entry.path_length = (uint32_t)strlen(path);
+    entry.edit_count = (uint32_t)edit_count;
+    entry.signature = *signature;
+    for (size_t i = 0; i < edit_count; i++)
+    {
+        entry.edits_size += sizeof(JournalEdit) + edits[i].removed_length + edits[i].inserted_length;
+    }
+
+    size_t record_size = sizeof(JournalEntry) + entry.path_length + entry.edits_size;
+    char *record = (char *)arena_allocate(arena, record_size);
+    char *write_pos = record;
+    memcpy(write_pos, &entry, sizeof(JournalEntry));
+    write_pos += sizeof(JournalEntry);
+    memcpy(write_pos, path, entry.path_length);
+    write_pos += entry.path_length;
+    for (size_t i = 0; i < edit_count; i++)
+    {
+        JournalEdit edit;
+        edit.offset = edits[i].offset;
+        edit.removed_length = (uint32_t)edits[i].removed_length;
+        edit.inserted_length = (uint32_t)edits[i].inserted_length;
+        memcpy(write_pos, &edit, sizeof(JournalEdit));
+        write_pos += sizeof(JournalEdit);
+        memcpy(write_pos, file->data + edits[i].offset, edits[i].removed_length);
+        write_pos += edits[i].removed_length;
+        for (size_t n = edits[i].first_piece; n < edits[i].end_piece; n++)
+        {
+            memcpy(write_pos, pieces[n].text, pieces[n].length);
+            write_pos += pieces[n].length;
+        }
+    }
+
+    EditPiece piece;
+    piece.text = record;
+    piece.length = record_size;
+    pthread_mutex_lock(&journal->mutex);
+    bool success = write_edit_pieces(journal->fd, &piece, 1);
+    if (success) journal->entry_count++;
+    pthread_mutex_unlock(&journal->mutex);
+    return success;
+}
+
+//Undoing finds each edit shifted by what the edits before it added
+static void push_journal_pieces(EditState *edit, const MappedFile *current,
+    const char *edits, uint32_t edit_count, bool is_redo)
+{
+    size_t cursor = 0;
+    int64_t shift = 0;
+    for (uint32_t i = 0; i < edit_count; i++)
+    {
+        JournalEdit journal_edit;
+        memcpy(&journal_edit, edits, sizeof(JournalEdit));
+        const char *removed = edits + sizeof(JournalEdit);
+        const char *inserted = removed + journal_edit.removed_length;
+        edits = inserted + journal_edit.inserted_length;
+
+        size_t position = (size_t)((int64_t)journal_edit.offset + shift);
+        push_edit_piece(edit, current->data + cursor, position - cursor);
+        if (is_redo)
+        {
+            push_edit_piece(edit, inserted, journal_edit.inserted_length);
+            cursor = position + journal_edit.removed_length;
+        }
+        else
+        {
+            push_edit_piece(edit, removed, journal_edit.removed_length);
+            cursor = position + journal_edit.inserted_length;
+            shift += (int64_t)journal_edit.inserted_length - (int64_t)journal_edit.removed_length;
+        }
+    }
+    push_edit_piece(edit, current->data + cursor, current->size - cursor);
+}
+
+static int run_journal_command(bool is_redo)
+{
+    uint64_t applied_count = read_applied_run_count();
+    uint64_t run_index = is_redo ? applied_count + 1 : applied_count;
+    char journal_path[PATH_MAX];
+    get_journal_path(journal_path, sizeof(journal_path), run_index);
+
+    MappedFile journal;
+    if (run_index == 0 || !map_file(journal_path, &journal))
+    {
+        fprintf(stderr, "Nothing to %s\n", is_redo ? "redo" : "undo");
+        return 1;
+    }
+    if (journal.size < JOURNAL_MAGIC_SIZE || memcmp(journal.data, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0)
+    {
+        fprintf(stderr, "%s is not an undo journal\n", journal_path);
+        unmap_file(&journal);
+        return 1;
+    }
+
+    EditState edit = {};
+    size_t *entry_offsets = NULL;
+    size_t entry_count = 0, entry_capacity = 0;
+    size_t failed_count = 0;
+    size_t offset = JOURNAL_MAGIC_SIZE;
+    while (offset + sizeof(JournalEntry) <= journal.size)
+    {
+        JournalEntry entry;
+        memcpy(&entry, journal.data + offset, sizeof(JournalEntry));
+        if (offset + sizeof(JournalEntry) + entry.path_length + entry.edits_size > journal.size) break;
+        *push_array_element(&edit.arena, entry_offsets, entry_count, entry_capacity) = offset;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s", (int)entry.path_length, journal.data + offset + sizeof(JournalEntry));
+        struct stat st;
+        FileSignature signature = {};
+        if (stat(path, &st) == 0) signature = get_file_signature(&st);
+        if (!signatures_match(&signature, &entry.signature))
+        {
+            fprintf(stderr, "%s has changed since ductus %s it\n", path, is_redo ? "undid" : "wrote");
+            failed_count++;
+        }
+        offset += sizeof(JournalEntry) + entry.path_length + entry.edits_size;
+    }
+    if (offset != journal.size)
+    {
+        fprintf(stderr, "%s is damaged\n", journal_path);
+        failed_count++;
+    }
+
+    //A journal that took the signatures of a run that failed halfway would let
+    //a retry apply the edits to those files a second time
+    char **temp_paths = (char **)arena_allocate(&edit.arena, sizeof(char *) * (entry_count + 1));
+    char **targets = (char **)arena_allocate(&edit.arena, sizeof(char *) * (entry_count + 1));
+    FileSignature *signatures = (FileSignature *)arena_allocate(&edit.arena, sizeof(FileSignature) * (entry_count + 1));
+    size_t staged_count = 0;
+    for (size_t i = 0; i < entry_count && failed_count == 0; i++)
+    {
+        JournalEntry entry;
+        memcpy(&entry, journal.data + entry_offsets[i], sizeof(JournalEntry));
+        const char *path_text = journal.data + entry_offsets[i] + sizeof(JournalEntry);
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s", (int)entry.path_length, path_text);
+
+        MappedFile current;
+        if (!map_file(path, &current))
+        {
+            fprintf(stderr, "Could not open file %s\n", path);
+            failed_count++;
+            break;
+        }
+
+        StagedFile staged;
+        push_journal_pieces(&edit, &current, path_text + entry.path_length, entry.edit_count, is_redo);
+        if (stage_file(path, current.mode, edit.pieces, edit.piece_count, &signatures[i], &staged))
+        {
+            size_t temp_length = strlen(staged.temp_path) + 1;
+            size_t target_length = strlen(staged.target) + 1;
+            temp_paths[i] = (char *)memcpy(arena_allocate(&edit.arena, temp_length), staged.temp_path, temp_length);
+            targets[i] = (char *)memcpy(arena_allocate(&edit.arena, target_length), staged.target, target_length);
+            staged_count++;
+        }
+        else
+        {
+            fprintf(stderr, "Could not write file %s\n", path);
+            failed_count++;
+        }
+        edit.piece_count = 0;
+        unmap_file(&current);
+    }
+
+    StagedFile staged_journal;
+    if (failed_count == 0)
+    {
+        size_t copied = 0;
+        for (size_t i = 0; i < entry_count; i++)
+        {
+            size_t signature_offset = entry_offsets[i] + offsetof(JournalEntry, signature);
+            push_edit_piece(&edit, journal.data + copied, signature_offset - copied);
+            push_edit_piece(&edit, (const char *)&signatures[i], sizeof(FileSignature));
+            copied = signature_offset + sizeof(FileSignature);
+        }
+        push_edit_piece(&edit, journal.data + copied, journal.size - copied);
+        if (!stage_file(journal_path, 0644, edit.pieces, edit.piece_count, NULL, &staged_journal))
+        {
+            fprintf(stderr, "Could not update %s\n", journal_path);
+            failed_count++;
+        }
+        edit.piece_count = 0;
+    }
+
+    size_t committed_count = 0;
+    for (size_t i = 0; i < staged_count; i++)
+    {
+        if (failed_count == 0 && commit_staged_file(temp_paths[i], targets[i]))
+        {
+            committed_count++;
+            continue;
+        }
+        if (failed_count == 0)
+        {
+            fprintf(stderr, "Could not replace %s\n", targets[i]);
+            failed_count++;
+            unlink(staged_journal.temp_path);
+        }
+        unlink(temp_paths[i]);
+    }
+    if (committed_count > 0 && committed_count < staged_count)
+    {
+        fprintf(stderr, "%zu of %zu files were already replaced, the journal is left as it was "
+            "so they won't be %s again\n", committed_count, entry_count, is_redo ? "redone" : "undone");
+    }
+
+    //A journal left behind only stops a redo, one that went in alone would
+    //let a retry apply the run again
+    if (failed_count == 0 && !write_applied_run_count(is_redo ? run_index : run_index - 1))
+    {
+        fprintf(stderr, "Could not update %s/applied\n", JOURNAL_DIRECTORY);
+        failed_count++;
+        unlink(staged_journal.temp_path);
+    }
+    if (failed_count == 0 && !commit_staged_file(staged_journal.temp_path, staged_journal.target))
+    {
+        fprintf(stderr, "Could not update %s\n", journal_path);
+        failed_count++;
+    }
+    if (failed_count == 0)
+    {
+        printf("%s run %llu, %zu files\n", is_redo ? "Redid" : "Undid", (unsigned long long)run_index, entry_count);
+    }
+
+    free_edit_state(&edit);
+    unmap_file(&journal);
+    return failed_count == 0 ? 0 : 1;
+}
+
+//=========================================================
+// Unified diff
+//=========================================================
+
+//Within a change every old line is removed and every new one added,
+//without looking for the lines the two have in common
+
+#define DIFF_CONTEXT_LINES 3
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} DiffText;
+
+typedef struct {
+    const char *old_begin;         //Whole lines of the original
+    const char *old_end;
+    size_t old_line;               //Of old_begin, counting from 0
+    size_t old_line_count;
+    size_t new_offset;             //Into the text of the new lines, whole lines too
+    size_t new_length;
+    size_t new_line_count;
+} DiffChange;
+
+static void append_diff_text(MemoryArena *arena, DiffText *text, const char *data, size_t length)
+{
+    if (text->length + length > text->capacity)
+    {
+        size_t capacity = text->capacity ? text->capacity * 2 : 4096;
+        while (capacity < text->length + length) capacity *= 2;
+        text->data = (char *)arena_resize(arena, text->data, text->capacity, capacity);
+        text->capacity = capacity;
+    }
+    memcpy(text->data + text->length, data, length);
+    text->length += length;
+}
+
+static inline const char *find_diff_line_begin(const char *data, const char *cursor)
+{
+    while (cursor > data && cursor[-1] != '\n') cursor--;
+    return cursor;
+}
+
+static inline const char *find_diff_line_end(const char *cursor, const char *end)
+{
+    const char *newline = (const char *)memchr(cursor, '\n', end - cursor);
+    return newline != NULL ? newline + 1 : end;
+}
+
+//Line breaks that are only a '\r' don't start a line in a diff
+static size_t count_diff_lines(const char *cursor, const char *end)
+{
+    size_t result = 0;
+    const char *begin = cursor;
+    while (cursor < end && (cursor = (const char *)memchr(cursor, '\n', end - cursor)) != NULL)
+    {
+        result++;
+        cursor++;
+    }
+    if (end > begin && end[-1] != '\n') result++;
+    return result;
+}
+
+static void append_diff_lines(MemoryArena *arena, DiffText *output, char prefix, const char *text, size_t length)
+{
+    const char *cursor = text;
+    const char *end = text + length;
+    while (cursor < end)
+    {
+        const char *line_end = find_diff_line_end(cursor, end);
+        append_diff_text(arena, output, &prefix, 1);
+        append_diff_text(arena, output, cursor, line_end - cursor);
+        if (line_end[-1] != '\n')
+        {
+            static const char NO_NEWLINE[] = "\n\\ No newline at end of file\n";
+            append_diff_text(arena, output, NO_NEWLINE, static_strlen(NO_NEWLINE));
+        }
+        cursor = line_end;
+    }
+}
+
+static void write_file_diff(MemoryArena *arena, const char *filename, const MappedFile *file,
+    const EditPiece *pieces, size_t piece_count)
+{
+    PieceEdit *edits;
+    size_t edit_count = find_piece_edits(arena, file->data, file->size, pieces, piece_count, &edits);
+    const char *data = file->data;
+    const char *data_end = file->data + file->size;
+
+    DiffChange *changes = NULL;
+    size_t change_count = 0, change_capacity = 0;
+    DiffText new_text = {};
+    const char *counted = data;
+    size_t counted_lines = 0;
+    for (size_t i = 0; i < edit_count;)
+    {
+        DiffChange *change = push_array_element(arena, changes, change_count, change_capacity);
+        change->old_begin = find_diff_line_begin(data, data + edits[i].offset);
+        change->new_offset = new_text.length;
+        counted_lines += count_diff_lines(counted, change->old_begin);
+        counted = change->old_begin;
+        change->old_line = counted_lines;
+
+        const char *cursor = change->old_begin;
+        while (true)
+        {
+            const PieceEdit *edit = &edits[i++];
+            append_diff_text(arena, &new_text, cursor, data + edit->offset - cursor);
+            for (size_t n = edit->first_piece; n < edit->end_piece; n++)
+            {
+                append_diff_text(arena, &new_text, pieces[n].text, pieces[n].length);
+            }
+            cursor = data + edit->offset + edit->removed_length;
+
+            bool is_new_whole = new_text.length == change->new_offset || new_text.data[new_text.length - 1] == '\n';
+            bool is_line_begin = cursor == data || cursor[-1] == '\n';
+            change->old_end = is_new_whole && is_line_begin ? cursor : find_diff_line_end(cursor, data_end);
+            if (i == edit_count || find_diff_line_begin(data, data + edits[i].offset) >= change->old_end) break;
+        }
+        append_diff_text(arena, &new_text, cursor, change->old_end - cursor);
+        change->old_line_count = count_diff_lines(change->old_begin, change->old_end);
+        change->new_length = new_text.length - change->new_offset;
+        change->new_line_count = count_diff_lines(new_text.data + change->new_offset,
+            new_text.data + new_text.length);
+    }
+
+    DiffText output = {};
+    char header[PATH_MAX * 2 + 16];
+    int header_length = snprintf(header, sizeof(header), "--- %s\n+++ %s\n", filename, filename);
+    append_diff_text(arena, &output, header, (size_t)header_length < sizeof(header) ? header_length : sizeof(header) - 1);
+
+    int64_t line_delta = 0;
+    for (size_t first = 0; first < change_count;)
+    {
+        size_t last = first;
+        while (last + 1 < change_count && changes[last + 1].old_line -
+            (changes[last].old_line + changes[last].old_line_count) <= 2 * DIFF_CONTEXT_LINES)
+        {
+            last++;
+        }
+
+        const char *context_begin = changes[first].old_begin;
+        size_t context_line = changes[first].old_line;
+        for (size_t n = 0; n < DIFF_CONTEXT_LINES && context_begin > data; n++)
+        {
+            context_begin = find_diff_line_begin(data, context_begin - 1);
+            context_line--;
+        }
+        const char *context_end = changes[last].old_end;
+        size_t context_after = 0;
+        for (; context_after < DIFF_CONTEXT_LINES && context_end < data_end; context_after++)
+        {
+            context_end = find_diff_line_end(context_end, data_end);
+        }
+
+        size_t old_count = changes[last].old_line + changes[last].old_line_count - context_line + context_after;
+        size_t new_count = old_count;
+        for (size_t n = first; n <= last; n++)
+        {
+            new_count += changes[n].new_line_count - changes[n].old_line_count;
+        }
+        size_t new_line = (size_t)((int64_t)context_line + line_delta);
+        header_length = snprintf(header, sizeof(header), "@@ -%zu,%zu +%zu,%zu @@\n",
+            old_count > 0 ? context_line + 1 : context_line, old_count,
+            new_count > 0 ? new_line + 1 : new_line, new_count);
+        append_diff_text(arena, &output, header, header_length);
+
+        const char *emitted = context_begin;
+        for (size_t n = first; n <= last;)
+        {
+            size_t run_end = n + 1;
+            while (run_end <= last && changes[run_end].old_begin == changes[run_end - 1].old_end) run_end++;
+            const DiffChange *run_first = &changes[n];
+            const DiffChange *run_last = &changes[run_end - 1];
+            append_diff_lines(arena, &output, ' ', emitted, run_first->old_begin - emitted);
+            append_diff_lines(arena, &output, '-', run_first->old_begin, run_last->old_end - run_first->old_begin);
+            append_diff_lines(arena, &output, '+', new_text.data + run_first->new_offset,
+                run_last->new_offset + run_last->new_length - run_first->new_offset);
+            for (; n < run_end; n++)
+            {
+                line_delta += (int64_t)changes[n].new_line_count - (int64_t)changes[n].old_line_count;
+            }
+            emitted = run_last->old_end;
+        }
+        append_diff_lines(arena, &output, ' ', emitted, context_end - emitted);
+        first = last + 1;
+    }
+
+    //One write per file keeps the diffs of different threads from interleaving
+    flockfile(stdout);
+    fwrite(output.data, 1, output.length, stdout);
+    funlockfile(stdout);
+}
+
+//=========================================================
+// Skip cache
+//=========================================================
+
+//A file is only skipped when its content hashes to a key already in the
+//cache, never because of its name or mtime.  Anything that changes what a
+//file comes out as bumps SKIP_CACHE_VERSION
+
+#define SKIP_CACHE_FILENAME ".ductus_cache"
+#define SKIP_CACHE_MAGIC "DUCTUSC1"
+#define SKIP_CACHE_MAGIC_SIZE 8
+#define SKIP_CACHE_MAX_KEYS (1 << 20)
+#define SKIP_CACHE_VERSION 1
+
+typedef struct {
+    uint64_t hash;
+    uint64_t size;
+} ContentKey;
+
+typedef struct {
+    char magic[SKIP_CACHE_MAGIC_SIZE];
+    uint64_t procedure_stamp;
+    uint64_t key_count;
+} SkipCacheHeader;
+
+typedef struct {
+    ContentKey *keys;              //Sorted, as loaded
+    uint8_t *is_used;              //Set for the keys this run hit
+    size_t key_count;
+
+    ContentKey *new_keys;
+    size_t new_key_count;
+    size_t new_key_capacity;
+    pthread_mutex_t mutex;
+} SkipCache;
+
+static inline uint64_t rotate_left64(uint64_t value, int count)
+{
+    return (value << count) | (value >> (64 - count));
+}
+
+static inline uint64_t mix_content_lane(uint64_t lane, uint64_t word)
+{
+    lane += word * 0xC2B2AE3D27D4EB4Full;
+    lane = rotate_left64(lane, 31);
+    return lane * 0x9E3779B185EBCA87ull;
+}
+
+//Four independent lanes so the multiplies overlap
+static uint64_t hash_content(const char *data, size_t size)
+{
+    uint64_t lanes[4] = { 0x60EA27EEADC0B5D6ull, 0xC2B2AE3D27D4EB4Full, 0, 0x61C8864E7A143579ull };
+    const char *cursor = data;
+    const char *end = data + size;
+    while (end - cursor >= 32)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            uint64_t word;
+            memcpy(&word, cursor + i * 8, 8);
+            lanes[i] = mix_content_lane(lanes[i], word);
+        }
+        cursor += 32;
+    }
+
+    uint64_t hash = rotate_left64(lanes[0], 1) + rotate_left64(lanes[1], 7) +
+        rotate_left64(lanes[2], 12) + rotate_left64(lanes[3], 18) + size;
+    while (end - cursor >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, cursor, 8);
+        hash = rotate_left64(hash ^ mix_content_lane(0, word), 27) * 0x9E3779B185EBCA87ull;
+        cursor += 8;
+    }
+    if (cursor < end)
+    {
+        uint64_t word = 0;
+        memcpy(&word, cursor, end - cursor);
+        hash = rotate_left64(hash ^ mix_content_lane(0, word), 27) * 0x9E3779B185EBCA87ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xC2B2AE3D27D4EB4Full;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+static inline int compare_content_keys(const void *a, const void *b)
+{
+    const ContentKey *key_a = (const ContentKey *)a;
+    const ContentKey *key_b = (const ContentKey *)b;
+    if (key_a->hash != key_b->hash) return key_a->hash < key_b->hash ? -1 : 1;
+    if (key_a->size != key_b->size) return key_a->size < key_b->size ? -1 : 1;
+    return 0;
+}
+
+static uint64_t get_procedure_stamp()
+{
+    static const char PROCEDURE_STAMP[] =
+#define ProcedureEntry(token, name, flags, ...) name " " #flags "\n"
+        ProcedureList
+#undef ProcedureEntry
+        ;
+    return hash_content(PROCEDURE_STAMP, static_strlen(PROCEDURE_STAMP)) + SKIP_CACHE_VERSION;
+}
+
+static void load_skip_cache(SkipCache *cache)
+{
+    memset(cache, 0, sizeof(SkipCache));
+    pthread_mutex_init(&cache->mutex, NULL);
+
+    MappedFile file;
+    if (!map_file(SKIP_CACHE_FILENAME, &file)) return;
+    SkipCacheHeader header;
+    if (file.size >= sizeof(SkipCacheHeader))
+    {
+        memcpy(&header, file.data, sizeof(SkipCacheHeader));
+        if (memcmp(header.magic, SKIP_CACHE_MAGIC, SKIP_CACHE_MAGIC_SIZE) == 0 &&
+            header.procedure_stamp == get_procedure_stamp() &&
+            header.key_count <= SKIP_CACHE_MAX_KEYS &&
+            file.size == sizeof(SkipCacheHeader) + header.key_count * sizeof(ContentKey))
+        {
+            cache->key_count = header.key_count;
+            cache->keys = (ContentKey *)malloc(sizeof(ContentKey) * (cache->key_count + 1));
+            cache->is_used = (uint8_t *)calloc(cache->key_count + 1, 1);
+            memcpy(cache->keys, file.data + sizeof(SkipCacheHeader), sizeof(ContentKey) * cache->key_count);
+        }
+    }
+    unmap_file(&file);
+}
+
+static bool find_skip_cache_key(SkipCache *cache, const ContentKey *key)
+{
+    size_t low = 0, high = cache->key_count;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        int order = compare_content_keys(&cache->keys[middle], key);
+        if (order == 0)
+        {
+            __atomic_store_n(&cache->is_used[middle], 1, __ATOMIC_RELAXED);
+            return true;
+        }
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+    return false;
+}
+
+static void add_skip_cache_key(SkipCache *cache, const ContentKey *key)
+{
+    pthread_mutex_lock(&cache->mutex);
+    *push_array_element((MemoryArena *)NULL, cache->new_keys, cache->new_key_count, cache->new_key_capacity) = *key;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+//Keys from earlier runs are kept so a build over part of the tree doesn't
+//forget the rest
+static void save_skip_cache(SkipCache *cache)
+{
+    size_t kept_count = 0;
+    bool is_full = cache->key_count + cache->new_key_count > SKIP_CACHE_MAX_KEYS;
+    for (size_t i = 0; i < cache->key_count; i++)
+    {
+        if (!is_full || cache->is_used[i]) cache->keys[kept_count++] = cache->keys[i];
+    }
+
+    size_t key_count = 0;
+    ContentKey *keys = (ContentKey *)malloc(sizeof(ContentKey) * (kept_count + cache->new_key_count + 1));
+    memcpy(keys, cache->keys, sizeof(ContentKey) * kept_count);
+    memcpy(keys + kept_count, cache->new_keys, sizeof(ContentKey) * cache->new_key_count);
+    qsort(keys, kept_count + cache->new_key_count, sizeof(ContentKey), compare_content_keys);
+    for (size_t i = 0; i < kept_count + cache->new_key_count; i++)
+    {
+        if (key_count == 0 || compare_content_keys(&keys[key_count - 1], &keys[i]) != 0) keys[key_count++] = keys[i];
+    }
+    if (key_count > SKIP_CACHE_MAX_KEYS) key_count = SKIP_CACHE_MAX_KEYS;
+
+    bool is_changed = cache->new_key_count > 0 || key_count != cache->key_count;
+    if (is_changed)
+    {
+        SkipCacheHeader header = {};
+        memcpy(header.magic, SKIP_CACHE_MAGIC, SKIP_CACHE_MAGIC_SIZE);
+        header.procedure_stamp = get_procedure_stamp();
+        header.key_count = key_count;
+        EditPiece pieces[2];
+        pieces[0].text = (const char *)&header;
+        pieces[0].length = sizeof(SkipCacheHeader);
+        pieces[1].text = (const char *)keys;
+        pieces[1].length = sizeof(ContentKey) * key_count;
+        if (!write_file_atomic(SKIP_CACHE_FILENAME, 0644, pieces, 2, NULL))
+        {
+            fprintf(stderr, "Could not write %s\n", SKIP_CACHE_FILENAME);
+        }
+    }
+
+    free(keys);
+    free(cache->keys);
+    free(cache->is_used);
+    free(cache->new_keys);
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+typedef struct {
+    const char *begin;
+    const char *end;
+    uint32_t first_scope;          //Into the scope table of the whole file
+    uint32_t scope_count;
+    uint32_t line_number;
+    Lexer lex;
+    EditState edit;
+    jmp_buf error_jump;
+    int result;
+} SplitChunk;
+
+typedef struct {
+    Lexer lex;
+    EditState edit;
+    jmp_buf error_jump;
+
+    size_t split_thread_count;     //Big files are split across this many threads when above 1
+    SplitChunk *split_chunks;
+    size_t split_chunk_count;      //Set up so far, only some of them are used by a file
+    size_t split_chunk_capacity;
+
+    Journal *journal;              //Rewrites are recorded here when not NULL
+    bool is_diff;                  //Write a diff to stdout instead of the file
+    size_t pending_count;          //Files a diff was written for
+    SkipCache *skip_cache;         //Files known to be left alone are skipped when not NULL
+    const ScriptPlan *plan;        //Rules of a --script applied to every file when not NULL
+} Worker;
+
+static void begin_lexer(Worker *worker, const char *buffer, size_t size, const char *filename)
+{
+    Lexer *lex = &worker->lex;
+    lex->buffer_size = size;
+    lex->buffer = buffer;
+    lex->current = buffer;
+    lex->line_number = 0;
+    lex->line_offset = 0;
+    lex->is_first_token_in_line = true;
+    lex->token.type = TokenType_INVALID;
+    lex->filename = filename;
+    lex->error_jump = &worker->error_jump;
+    lex->is_streaming = false;
+    lex->is_partial = false;
+    lex->top_level_boundary = buffer;
+    lex->token_count = 0;
+}
+
+static void free_worker(Worker *worker)
+{
+    for (size_t i = 0; i < worker->split_chunk_count; i++)
+    {
+        free_edit_state(&worker->split_chunks[i].edit);
+    }
+    free(worker->split_chunks);
+    free_edit_state(&worker->edit);
+}
+
+//=========================================================
+// Script plans
+//=========================================================
+
+//Script rules act as if declared in a scope around the whole file, so a
+//rule in the file itself always wins
+
+//Has to run before anything else puts rules in, the rule set of the plan
+//refers to the rules by their index
+static void push_script_plan_rules(EditState *edit, const ScriptPlan *plan,
+    const char *begin, const char *end)
+{
+    assert(edit->replace_rule_count == 0 && edit->replace_scope_count == 0);
+    ReplaceScope *scope = push_array_element(&edit->arena, edit->replace_scopes, edit->replace_scope_count, edit->replace_scope_capacity);
+    scope->begin = begin;
+    scope->end = end;
+    for (size_t i = 0; i < plan->rule_count; i++)
+    {
+        *push_array_element(&edit->arena, edit->replace_rules, edit->replace_rule_count, edit->replace_rule_capacity) = plan->rules[i];
+    }
+    edit->plan_rule_set = &plan->rule_set;
+}
+
+static bool compile_script_plan(const char *filename, ScriptPlan *plan)
+{
+    memset(plan, 0, sizeof(ScriptPlan));
+    MappedFile file;
+    if (!map_file(filename, &file))
+    {
+        fprintf(stderr, "Could not open script %s\n", filename);
+        return false;
+    }
+
+    Worker *worker = (Worker *)calloc(1, sizeof(Worker));
+    EditState *edit = &worker->edit;
+    begin_lexer(worker, file.data, file.size, filename);
+    bool result = setjmp(worker->error_jump) == 0;
+    if (result)
+    {
+        parse_block(&worker->lex, edit);
+    }
+
+    for (size_t i = 0; result && i < edit->source_edit_count; i++)
+    {
+        if (edit->source_edits[i].text != NULL)
+        {
+            fprintf(stderr, "%s: only identifier procedures can be used in a script\n", filename);
+            result = false;
+        }
+    }
+    for (size_t i = 0; result && i < edit->replace_rule_count; i++)
+    {
+        const ReplaceRule *rule = &edit->replace_rules[i];
+        if (edit->replace_scopes[rule->scope_index].begin != file.data)
+        {
+            fprintf(stderr, "%s: the procedures of a script can't be inside of braces\n", filename);
+            result = false;
+        }
+    }
+    if (result && edit->replace_rule_count == 0)
+    {
+        fprintf(stderr, "%s: the script has no procedures in it\n", filename);
+        result = false;
+    }
+
+    if (result)
+    {
+        uint32_t *rule_indices = (uint32_t *)arena_allocate(&plan->arena, sizeof(uint32_t) * edit->replace_rule_count);
+        size_t text_rule_count = 0;
+        for (size_t i = 0; i < edit->replace_rule_count; i++)
+        {
+            const ReplaceRule *rule = &edit->replace_rules[i];
+            char *text = (char *)arena_allocate(&plan->arena, rule->target_length + rule->replacement_length + 1);
+            memcpy(text, rule->target, rule->target_length);
+            memcpy(text + rule->target_length, rule->replacement, rule->replacement_length);
+
+            ReplaceRule *copy = push_array_element(&plan->arena, plan->rules, plan->rule_count, plan->rule_capacity);
+            *copy = *rule;
+            copy->target = text;
+            copy->replacement = text + rule->target_length;
+            copy->scope_index = 0;
+            if (rule->kind == ReplaceKind_TEXT || rule->kind == ReplaceKind_WORD) rule_indices[text_rule_count++] = (uint32_t)i;
+        }
+        build_replace_rule_set(&plan->arena, &plan->rule_set, plan->rules, rule_indices, text_rule_count);
+        plan->hash = hash_content(file.data, file.size);
+    }
+
+    free_worker(worker);
+    free(worker);
+    unmap_file(&file);
+    return result;
+}
+
+//=========================================================
+// Split files
+//=========================================================
+
+
+#define SPLIT_MIN_FILE_SIZE (1024 * 1024)
+#define SPLIT_MIN_CHUNK_SIZE (256 * 1024)
+#define SPLIT_CHUNKS_PER_THREAD 4
+
+typedef enum {
+    SplitPhase_COUNT_LINES,
+    SplitPhase_PARSE,
+    SplitPhase_RESOLVE,
+} SplitPhase;
+
+typedef struct {
+    Worker *worker;
+    size_t chunk_count;
+    pthread_t *threads;
+    size_t thread_count;
+    SplitPhase phase;
+    size_t next_chunk;
+
+    ReplaceRule *file_rules;       //Of every chunk, in file order
+    size_t file_rule_count;
+    size_t file_rule_capacity;
+} SplitRun;
+
+//Nothing is ever open after a top level '}', a literal, comment or #fl
+//around it would have kept it out of the scope table
+static size_t split_file(Worker *worker)
+{
+    const Lexer *lex = &worker->lex;
+    const EditState *edit = &worker->edit;
+    const char *buffer_end = lex->buffer + lex->buffer_size;
+    size_t chunk_size = lex->buffer_size / (worker->split_thread_count * SPLIT_CHUNKS_PER_THREAD);
+    if (chunk_size < SPLIT_MIN_CHUNK_SIZE) chunk_size = SPLIT_MIN_CHUNK_SIZE;
+
+    size_t chunk_count = 0;
+    const char *chunk_begin = lex->buffer;
+    uint32_t scope_index = 0;
+    uint32_t first_scope = 0;
+    while (chunk_begin < buffer_end)
+    {
+        const char *chunk_end = buffer_end;
+        for (; scope_index < edit->scope_count; scope_index++)
+        {
+            const Scope *scope = &edit->scopes[scope_index];
+            if (scope->parent != SCOPE_NONE || scope->end >= buffer_end) continue;
+            if ((size_t)(scope->end + 1 - chunk_begin) >= chunk_size)
+            {
+                chunk_end = scope->end + 1;
+                break;
+            }
+        }
+
+        uint32_t end_scope = first_scope;
+        while (end_scope < edit->scope_count && edit->scopes[end_scope].begin < chunk_end) end_scope++;
+
+        if (chunk_count == worker->split_chunk_count)
+        {
+            SplitChunk *new_chunk = push_array_element(NULL, worker->split_chunks, worker->split_chunk_count, worker->split_chunk_capacity);
+            memset(new_chunk, 0, sizeof(SplitChunk));
+        }
+        SplitChunk *chunk = &worker->split_chunks[chunk_count++];
+        chunk->begin = chunk_begin;
+        chunk->end = chunk_end;
+        chunk->first_scope = first_scope;
+        chunk->scope_count = end_scope - first_scope;
+        chunk_begin = chunk_end;
+        first_scope = end_scope;
+        scope_index = end_scope;
+    }
+    return chunk_count > 1 ? chunk_count : 0;
+}
+
+static void begin_chunk_lexer(const Worker *worker, SplitChunk *chunk)
+{
+    const char *line_start = chunk->begin;
+    while (line_start > worker->lex.buffer && line_start[-1] != '\n' && line_start[-1] != '\r') line_start--;
+    uint32_t newline_length = 0;
+    if (line_start > worker->lex.buffer)
+    {
+        newline_length = line_start - 1 > worker->lex.buffer && line_start[-1] == '\n' && line_start[-2] == '\r' ? 2 : 1;
+    }
+
+    Lexer *lex = &chunk->lex;
+    memset(lex, 0, sizeof(Lexer));
+    lex->buffer = chunk->begin;
+    lex->buffer_size = chunk->end - chunk->begin;
+    lex->current = chunk->begin;
+    lex->line_number = chunk->line_number;
+    lex->line_offset = newline_length + (uint32_t)(chunk->begin - line_start);
+    lex->is_first_token_in_line = line_start == chunk->begin;
+    lex->token.type = TokenType_INVALID;
+    lex->filename = worker->lex.filename;
+    lex->error_jump = &chunk->error_jump;
+    lex->top_level_boundary = chunk->begin;
+}
+
+static int find_chunk_file_scope(const SplitChunk *chunk)
+{
+    const EditState *edit = &chunk->edit;
+    for (size_t i = edit->plan_rule_set != NULL ? 1 : 0; i < edit->replace_scope_count; i++)
+    {
+        if (edit->replace_scopes[i].begin == chunk->begin) return (int)i;
+    }
+    return -1;
+}
+
+static void run_split_chunk(SplitRun *run, SplitChunk *chunk)
+{
+    Worker *worker = run->worker;
+    EditState *edit = &chunk->edit;
+    switch (run->phase)
+    {
+        case SplitPhase_COUNT_LINES:
+        {
+            reset_edit_state(edit);
+            chunk->line_number = (uint32_t)count_line_breaks(chunk->begin, chunk->end);
+            chunk->result = 0;
+        } break;
+
+        case SplitPhase_PARSE:
+        {
+            begin_chunk_lexer(worker, chunk);
+            int jump_code = setjmp(chunk->error_jump);
+            if (jump_code != 0)
+            {
+                chunk->result = jump_code;
+                return;
+            }
+
+            for (uint32_t i = 0; i < chunk->scope_count; i++)
+            {
+                Scope *scope = push_array_element(&edit->arena, edit->scopes, edit->scope_count, edit->scope_capacity);
+                *scope = worker->edit.scopes[chunk->first_scope + i];
+                if (scope->parent != SCOPE_NONE) scope->parent -= chunk->first_scope;
+            }
+            if (worker->plan != NULL) push_script_plan_rules(edit, worker->plan, chunk->begin, chunk->end);
+            parse_directives(&chunk->lex, edit);
+        } break;
+
+        //They all share one scope and keep their order, which is all their
+        //priority depends on
+        case SplitPhase_RESOLVE:
+        {
+            double replace_begin = get_seconds();
+            if (run->file_rule_count > 0)
+            {
+                int file_scope = find_chunk_file_scope(chunk);
+                if (file_scope == -1)
+                {
+                    file_scope = (int)edit->replace_scope_count;
+                    ReplaceScope *scope = push_array_element(&edit->arena, edit->replace_scopes, edit->replace_scope_count, edit->replace_scope_capacity);
+                    scope->begin = chunk->begin;
+                    scope->end = chunk->end;
+                }
+
+                size_t kept_count = 0;
+                for (size_t i = 0; i < edit->replace_rule_count; i++)
+                {
+                    if (edit->replace_rules[i].scope_index != (uint32_t)file_scope)
+                    {
+                        edit->replace_rules[kept_count++] = edit->replace_rules[i];
+                    }
+                }
+                edit->replace_rule_count = kept_count;
+                for (size_t i = 0; i < run->file_rule_count; i++)
+                {
+                    ReplaceRule *rule = push_array_element(&edit->arena, edit->replace_rules, edit->replace_rule_count, edit->replace_rule_capacity);
+                    *rule = run->file_rules[i];
+                    rule->scope_index = (uint32_t)file_scope;
+                }
+            }
+            resolve_edit_pieces(&chunk->lex, edit);
+            edit->stats.phase_seconds[StatsPhase_REPLACE] += get_seconds() - replace_begin;
+        } break;
+    }
+}
+
+static void *split_thread_proc(void *userdata)
+{
+    SplitRun *run = (SplitRun *)userdata;
+    while (true)
+    {
+        size_t index = __atomic_fetch_add(&run->next_chunk, 1, __ATOMIC_RELAXED);
+        if (index >= run->chunk_count) break;
+        run_split_chunk(run, &run->worker->split_chunks[index]);
+    }
+    return NULL;
+}
+
+static void run_split_phase(SplitRun *run, SplitPhase phase)
+{
+    run->phase = phase;
+    run->next_chunk = 0;
+    for (size_t i = 1; i < run->thread_count; i++)
+    {
+        pthread_create(&run->threads[i], NULL, split_thread_proc, run);
+    }
+    split_thread_proc(run);
+    for (size_t i = 1; i < run->thread_count; i++)
+    {
+        pthread_join(run->threads[i], NULL);
+    }
+}
+
+static int run_split_chunks(Worker *worker, size_t chunk_count)
+{
+    SplitRun run = {};
+    run.worker = worker;
+    run.chunk_count = chunk_count;
+    run.thread_count = worker->split_thread_count < chunk_count ? worker->split_thread_count : chunk_count;
+    run.threads = (pthread_t *)malloc(sizeof(pthread_t) * run.thread_count);
+    SplitChunk *chunks = worker->split_chunks;
+
+    run_split_phase(&run, SplitPhase_COUNT_LINES);
+    uint32_t line_number = worker->lex.line_number;
+    for (size_t i = 0; i < chunk_count; i++)
+    {
+        uint32_t line_count = chunks[i].line_number;
+        chunks[i].line_number = line_number;
+        line_number += line_count;
+    }
+
+    run_split_phase(&run, SplitPhase_PARSE);
+    int result = 0;
+    for (size_t i = 0; i < chunk_count && result == 0; i++) result = chunks[i].result;
+    if (result != 0)
+    {
+        free(run.threads);
+        return result;
+    }
+
+    EditState *edit = &worker->edit;
+    for (size_t i = 0; i < chunk_count; i++)
+    {
+        int file_scope = find_chunk_file_scope(&chunks[i]);
+        const EditState *chunk_edit = &chunks[i].edit;
+        for (size_t n = 0; file_scope != -1 && n < chunk_edit->replace_rule_count; n++)
+        {
+            if (chunk_edit->replace_rules[n].scope_index != (uint32_t)file_scope) continue;
+            *push_array_element(&edit->arena, run.file_rules, run.file_rule_count, run.file_rule_capacity) = chunk_edit->replace_rules[n];
+        }
+    }
+
+    run_split_phase(&run, SplitPhase_RESOLVE);
+    free(run.threads);
+
+    for (size_t i = 0; i < chunk_count; i++)
+    {
+        const EditState *chunk_edit = &chunks[i].edit;
+        for (size_t n = 0; n < chunk_edit->piece_count; n++)
+        {
+            push_edit_piece(edit, chunk_edit->pieces[n].text, chunk_edit->pieces[n].length);
+        }
+        for (size_t n = 0; n < StatsPhase_COUNT; n++)
+        {
+            edit->stats.phase_seconds[n] += chunk_edit->stats.phase_seconds[n];
+        }
+        edit->stats.token_count += chunk_edit->stats.token_count;
+        edit->stats.directive_count += chunk_edit->stats.directive_count;
+        edit->stats.arena_peak += chunk_edit->arena.peak_used + chunk_edit->scratch.peak_used;
+    }
+    return 0;
+}
+
+static int run_procedures(Worker *worker)
+{
+    int jump_code = setjmp(worker->error_jump);
+    if (jump_code != 0)
+    {
+        return jump_code;
+    }
+
+    EditState *edit = &worker->edit;
+    size_t chunk_count = 0;
+    bool has_directive = worker->lex.is_streaming || worker->plan != NULL ||
+        memchr(worker->lex.buffer, '#', worker->lex.buffer_size) != NULL;
+    const char *buffer_end = worker->lex.buffer + worker->lex.buffer_size;
+    if (!has_directive)
+    {
+        push_edit_piece(edit, worker->lex.buffer, worker->lex.buffer_size);
+    }
+    else if (worker->split_thread_count > 1 && !worker->lex.is_streaming &&
+        worker->lex.buffer_size >= SPLIT_MIN_FILE_SIZE)
+    {
+        double scopes_begin = get_seconds();
+        build_scope_table(&worker->lex, edit);
+        edit->stats.phase_seconds[StatsPhase_SCOPES] += get_seconds() - scopes_begin;
+        chunk_count = split_file(worker);
+        if (chunk_count == 0)
+        {
+            if (worker->plan != NULL) push_script_plan_rules(edit, worker->plan, worker->lex.buffer, buffer_end);
+            parse_directives(&worker->lex, edit);
+        }
+    }
+    else
+    {
+        if (worker->plan != NULL) push_script_plan_rules(edit, worker->plan, worker->lex.buffer, buffer_end);
+        parse_block(&worker->lex, edit);
+    }
+
+    if (chunk_count > 0)
+    {
+        jump_code = run_split_chunks(worker, chunk_count);
+        if (jump_code != 0) return jump_code;
+    }
+    else if (has_directive)
+    {
+        double replace_begin = get_seconds();
+        resolve_edit_pieces(&worker->lex, edit);
+        edit->stats.phase_seconds[StatsPhase_REPLACE] += get_seconds() - replace_begin;
+    }
+    edit->stats.input_bytes += worker->lex.buffer_size;
+    edit->stats.piece_count += edit->piece_count;
+    for (size_t i = 0; i < edit->piece_count; i++)
+    {
+        edit->stats.output_bytes += edit->pieces[i].length;
+    }
+    edit->stats.arena_peak += edit->arena.peak_used + edit->scratch.peak_used;
+    return 0;
+}
+
+static int process_file(Worker *worker, const char *filename, FileSignature *signature,
+    RunStats *stats)
+{
+    double read_begin = get_seconds();
+    MappedFile file;
+    if (!map_file(filename, &file))
+    {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        return 1;
+    }
+
+    EditState *edit = &worker->edit;
+    ContentKey key;
+    if (worker->skip_cache != NULL)
+    {
+        //What a file comes out as depends on the script too
+        key.hash = hash_content(file.data, file.size);
+        if (worker->plan != NULL) key.hash ^= worker->plan->hash;
+        key.size = file.size;
+        if (find_skip_cache_key(worker->skip_cache, &key))
+        {
+            edit->stats.phase_seconds[StatsPhase_READ] = get_seconds() - read_begin;
+            edit->stats.input_bytes = file.size;
+            edit->stats.output_bytes = file.size;
+            if (signature != NULL) *signature = file.signature;
+            if (stats != NULL) *stats = edit->stats;
+            reset_edit_state(edit);
+            unmap_file(&file);
+            return 0;
+        }
+    }
+
+    edit->stats.phase_seconds[StatsPhase_READ] = get_seconds() - read_begin;
+    begin_lexer(worker, file.data, file.size, filename);
+    if (run_procedures(worker) != 0)
+    {
+        reset_edit_state(edit);
+        unmap_file(&file);
+        return 1;
+    }
+
+    bool is_unchanged = (edit->piece_count == 0 && file.size == 0) ||
+        (edit->piece_count == 1 && edit->pieces[0].text == file.data &&
+         edit->pieces[0].length == file.size);
+
+    int result = 0;
+    FileSignature written = file.signature;
+    double write_begin = get_seconds();
+    if (!is_unchanged && worker->is_diff)
+    {
+        write_file_diff(&edit->arena, filename, &file, edit->pieces, edit->piece_count);
+        worker->pending_count++;
+    }
+    else if (!is_unchanged)
+    {
+        if (!write_file_atomic(filename, file.mode, edit->pieces, edit->piece_count, &written))
+        {
+            fprintf(stderr, "Could not write file %s\n", filename);
+            result = 1;
+        }
+        else if (worker->journal != NULL && !record_journal_entry(worker->journal, &edit->arena,
+            filename, &file, edit->pieces, edit->piece_count, &written))
+        {
+            fprintf(stderr, "Could not record %s in the undo journal\n", filename);
+        }
+    }
+    if (is_unchanged && worker->skip_cache != NULL) add_skip_cache_key(worker->skip_cache, &key);
+    edit->stats.phase_seconds[StatsPhase_WRITE] = get_seconds() - write_begin;
+    if (signature != NULL) *signature = written;
+    if (stats != NULL) *stats = edit->stats;
+
+    reset_edit_state(edit);
+    unmap_file(&file);
+    return result;
+}
+
+//=========================================================
+// Statistics
+//=========================================================
+
+//Each record goes out in a single write so records from different worker
+//threads never interleave
+typedef enum
+{
+    StatsFormat_NONE,
+    StatsFormat_TEXT,
+    StatsFormat_JSON,
+} StatsFormat;
+
+static void accumulate_run_stats(RunStats *total, const RunStats *run)
+{
+    for (size_t i = 0; i < StatsPhase_COUNT; i++)
+    {
+        total->phase_seconds[i] += run->phase_seconds[i];
+    }
+    total->input_bytes += run->input_bytes;
+    total->output_bytes += run->output_bytes;
+    total->token_count += run->token_count;
+    total->directive_count += run->directive_count;
+    total->piece_count += run->piece_count;
+    if (run->arena_peak > total->arena_peak) total->arena_peak = run->arena_peak;
+}
+
+static double get_total_seconds(const RunStats *stats)
+{
+    double result = 0.0;
+    for (size_t i = 0; i < StatsPhase_COUNT; i++) result += stats->phase_seconds[i];
+    return result;
+}
+
+static void append_record(char *record, size_t capacity, size_t *length, const char *format, ...)
+{
+    if (*length >= capacity) return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(record + *length, capacity - *length, format, args);
+    va_end(args);
+    if (written > 0) *length += (size_t)written;
+    if (*length > capacity) *length = capacity;
+}
+
+static void append_json_string(char *record, size_t capacity, size_t *length, const char *string)
+{
+    append_record(record, capacity, length, "\"");
+    for (const char *c = string; *c != 0; c++)
+    {
+        if (*c == '"' || *c == '\\') append_record(record, capacity, length, "\\%c", *c);
+        else if ((uint8_t)*c < 0x20) append_record(record, capacity, length, "\\u%04x", (uint8_t)*c);
+        else append_record(record, capacity, length, "%c", *c);
+    }
+    append_record(record, capacity, length, "\"");
+}
+
+static void append_json_stats(char *record, size_t capacity, size_t *length, const RunStats *stats)
+{
+    append_record(record, capacity, length, "\"seconds\":%.6f", get_total_seconds(stats));
+    for (size_t i = 0; i < StatsPhase_COUNT; i++)
+    {
+        append_record(record, capacity, length, ",\"%s_seconds\":%.6f", STATS_PHASE_NAMES[i], stats->phase_seconds[i]);
+    }
+    append_record(record, capacity, length,
+        ",\"input_bytes\":%zu,\"output_bytes\":%zu,\"tokens\":%zu,\"directives\":%zu,\"pieces\":%zu,\"arena_peak_bytes\":%zu",
+        stats->input_bytes, stats->output_bytes, stats->token_count, stats->directive_count,
+        stats->piece_count, stats->arena_peak);
+}
+
+static void print_run_stats(const char *name, const RunStats *stats, StatsFormat format)
+{
+    char record[8192];
+    size_t length = 0;
+    if (format == StatsFormat_JSON)
+    {
+        append_record(record, sizeof(record), &length, "{\"file\":");
+        append_json_string(record, sizeof(record), &length, name);
+        append_record(record, sizeof(record), &length, ",");
+        append_json_stats(record, sizeof(record), &length, stats);
+        append_record(record, sizeof(record), &length, "}\n");
+    }
+    else
+    {
+        append_record(record, sizeof(record), &length, "%s: %.3f ms (", name, get_total_seconds(stats) * 1000.0);
+        for (size_t i = 0; i < StatsPhase_COUNT; i++)
+        {
+            append_record(record, sizeof(record), &length, "%s%s %.3f", i ? ", " : "",
+                STATS_PHASE_NAMES[i], stats->phase_seconds[i] * 1000.0);
+        }
+        append_record(record, sizeof(record), &length,
+            "), %zu tokens, %zu directives, %zu pieces, %.1f KB in, %.1f KB out, %.1f KB arena peak\n",
+            stats->token_count, stats->directive_count, stats->piece_count,
+            (double)stats->input_bytes / 1024.0, (double)stats->output_bytes / 1024.0,
+            (double)stats->arena_peak / 1024.0);
+    }
+
+    if (length == sizeof(record)) record[length - 1] = '\n';
+    fwrite(record, 1, length, stderr);
+}
+
+//Phase times are summed over every thread so they can add up to more than
+//the wall time
+static void print_total_stats(const RunStats *total, size_t file_count, size_t failed_count,
+    double wall_seconds, StatsFormat format)
+{
+    double megabytes = (double)total->input_bytes / (1024.0 * 1024.0);
+    double throughput = wall_seconds > 0.0 ? megabytes / wall_seconds : 0.0;
+    if (format == StatsFormat_JSON)
+    {
+        char record[1024];
+        size_t length = 0;
+        append_record(record, sizeof(record), &length,
+            "{\"total\":true,\"files\":%zu,\"failed\":%zu,\"wall_seconds\":%.6f,\"megabytes_per_second\":%.3f,",
+            file_count, failed_count, wall_seconds, throughput);
+        append_json_stats(record, sizeof(record), &length, total);
+        append_record(record, sizeof(record), &length, "}\n");
+        fwrite(record, 1, length, stderr);
+        return;
+    }
+
+    double phase_total = get_total_seconds(total);
+    fprintf(stderr, "files       %zu (%zu failed)\n", file_count, failed_count);
+    fprintf(stderr, "wall        %10.3f ms %10.2f MB/s\n", wall_seconds * 1000.0, throughput);
+    for (size_t i = 0; i < StatsPhase_COUNT; i++)
+    {
+        fprintf(stderr, "%-11s %10.3f ms %9.1f%%\n", STATS_PHASE_NAMES[i], total->phase_seconds[i] * 1000.0,
+            phase_total > 0.0 ? total->phase_seconds[i] * 100.0 / phase_total : 0.0);
+    }
+    fprintf(stderr, "tokens      %10zu\n", total->token_count);
+    fprintf(stderr, "directives  %10zu\n", total->directive_count);
+    fprintf(stderr, "pieces      %10zu\n", total->piece_count);
+    fprintf(stderr, "input       %10.2f MB\n", megabytes);
+    fprintf(stderr, "output      %10.2f MB\n", (double)total->output_bytes / (1024.0 * 1024.0));
+    fprintf(stderr, "arena peak  %10.2f MB (largest single file)\n", (double)total->arena_peak / (1024.0 * 1024.0));
+}
+
+//=========================================================
+// Library interface
+//=========================================================
+
+//The caller's buffer can't be assumed to end in a null, so it is copied
+//into input
+struct DuctusContext {
+    Worker worker;
+    char *input;
+    size_t input_capacity;
+};
+
+ductus_context *ductus_create_context(void)
+{
+    ductus_context *context = (ductus_context *)calloc(1, sizeof(ductus_context));
+    return context;
+}
+
+void ductus_destroy_context(ductus_context *context)
+{
+    if (context == NULL) return;
+    free_worker(&context->worker);
+    free(context->input);
+    free(context);
+}
+
+int ductus_process_buffer(ductus_context *context, const char *input, size_t length,
+    ductus_output_proc *output_proc, void *user_data, const char *name)
+{
+    if (length + 1 > context->input_capacity)
+    {
+        size_t new_capacity = context->input_capacity ? context->input_capacity : 4096;
+        while (new_capacity < length + 1) new_capacity *= 2;
+        char *new_input = (char *)realloc(context->input, new_capacity);
+        if (new_input == NULL) return DUCTUS_ERROR;
+        context->input = new_input;
+        context->input_capacity = new_capacity;
+    }
+    memcpy(context->input, input, length);
+    context->input[length] = 0;
+
+    Worker *worker = &context->worker;
+    begin_lexer(worker, context->input, length, name);
+    if (run_procedures(worker) != 0)
+    {
+        reset_edit_state(&worker->edit);
+        return DUCTUS_ERROR;
+    }
+
+    for (size_t i = 0; i < worker->edit.piece_count; i++)
+    {
+        output_proc(user_data, worker->edit.pieces[i].text, worker->edit.pieces[i].length);
+    }
+    reset_edit_state(&worker->edit);
+    return DUCTUS_OK;
+}
+
+//=========================================================
+// Streaming mode
+//=========================================================
+
+//A chunk always ends on a line break so no token is ever split.  One that
+//a scope runs off the end of is grown and run again, so memory stays
+//bounded by the largest top level scope and not by the input
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+    uint64_t *hashes;              //0 is an empty slot
+    size_t hash_count;
+    size_t hash_capacity;
+    char *text;
+    size_t text_length;
+    size_t text_capacity;
+} WrittenNames;
+
+//File scope rules outlive their chunk, their text is copied out of the
+//window before it gets reused
+typedef struct {
+    ReplaceRule *rules;
+    size_t rule_count;
+    size_t rule_capacity;
+    WrittenNames written_names;
+} StreamRules;
+
+static void carry_stream_rules(StreamRules *carried, const EditState *edit,
+    size_t first_new_rule, const char *buffer_end)
+{
+    for (size_t i = first_new_rule; i < edit->replace_rule_count; i++)
+    {
+        const ReplaceRule *rule = &edit->replace_rules[i];
+        if (edit->replace_scopes[rule->scope_index].end != buffer_end) continue;
+
+        char *text = (char *)malloc(rule->target_length + rule->replacement_length);
+        memcpy(text, rule->target, rule->target_length);
+        memcpy(text + rule->target_length, rule->replacement, rule->replacement_length);
+
+        push_array_element(NULL, carried->rules, carried->rule_count, carried->rule_capacity);
+        memmove(carried->rules + 1, carried->rules, sizeof(ReplaceRule) * (carried->rule_count - 1));
+        ReplaceRule *copy = &carried->rules[0];
+        *copy = *rule;
+        copy->target = text;
+        copy->replacement = text + rule->target_length;
+        copy->scope_index = 0;
+    }
+}
+
+static inline uint64_t hash_written_name(const char *text, size_t length)
+{
+    uint64_t hash = hash_identifier_64(text, length);
+    return hash != 0 ? hash : 1;
+}
+
+static bool has_written_name(const WrittenNames *names, const ReplaceRule *rule)
+{
+    if (names->hash_count == 0) return false;
+    if (rule->kind == ReplaceKind_TEXT)
+    {
+        return memmem(names->text, names->text_length, rule->target, rule->target_length) != NULL;
+    }
+
+    uint64_t hash = hash_written_name(rule->target, rule->target_length);
+    size_t mask = names->hash_capacity - 1;
+    for (size_t slot = hash & mask; names->hashes[slot] != 0; slot = (slot + 1) & mask)
+    {
+        if (names->hashes[slot] == hash) return true;
+    }
+    return false;
+}
+
+static void add_written_name(WrittenNames *names, const char *text, size_t length)
+{
+    if ((names->hash_count + 1) * 2 > names->hash_capacity)
+    {
+        uint64_t *old_hashes = names->hashes;
+        size_t old_capacity = names->hash_capacity;
+        names->hash_capacity = old_capacity ? old_capacity * 2 : 4096;
+        names->hashes = (uint64_t *)calloc(names->hash_capacity, sizeof(uint64_t));
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_hashes[i] == 0) continue;
+            size_t slot = old_hashes[i] & (names->hash_capacity - 1);
+            while (names->hashes[slot] != 0) slot = (slot + 1) & (names->hash_capacity - 1);
+            names->hashes[slot] = old_hashes[i];
+        }
+        free(old_hashes);
+    }
+
+    uint64_t hash = hash_written_name(text, length);
+    size_t mask = names->hash_capacity - 1;
+    size_t slot = hash & mask;
+    for (; names->hashes[slot] != 0; slot = (slot + 1) & mask)
+    {
+        if (names->hashes[slot] == hash) return;
+    }
+    names->hashes[slot] = hash;
+    names->hash_count++;
+
+    if (names->text_length + length + 1 > names->text_capacity)
+    {
+        names->text_capacity = names->text_capacity ? names->text_capacity * 2 : 64 * 1024;
+        while (names->text_length + length + 1 > names->text_capacity) names->text_capacity *= 2;
+        names->text = (char *)realloc(names->text, names->text_capacity);
+    }
+    memcpy(names->text + names->text_length, text, length);
+    names->text[names->text_length + length] = 0;
+    names->text_length += length + 1;
+}
+
+static void add_written_names(WrittenNames *names, const char *text, size_t length)
+{
+    const char *run_begin = NULL;
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        uint64_t mask = 0;
+#ifdef SIMD_WIDTH
+        for (size_t n = 0; n < 64; n += SIMD_WIDTH)
+        {
+            mask |= (uint64_t)simd_identifier_mask(simd_load(text + i + n)) << n;
+        }
+#else
+        for (size_t n = 0; n < 64; n++)
+        {
+            char c = text[i + n];
+            if (is_alpha(c) || is_number(c) || c == '_') mask |= 1ull << n;
+        }
+#endif
+
+        size_t bit = 0;
+        while (bit < 64)
+        {
+            if (run_begin == NULL)
+            {
+                uint64_t rest = mask >> bit;
+                if (rest == 0) break;
+                bit += __builtin_ctzll(rest);
+                run_begin = text + i + bit;
+            }
+            uint64_t rest = ~mask >> bit;
+            if (rest == 0) break;
+            bit += __builtin_ctzll(rest);
+            add_written_name(names, run_begin, text + i + bit - run_begin);
+            run_begin = NULL;
+        }
+    }
+
+    for (; i < length; i++)
+    {
+        char c = text[i];
+        bool is_identifier = is_alpha(c) || is_number(c) || c == '_';
+        if (is_identifier && run_begin == NULL) run_begin = text + i;
+        if (!is_identifier && run_begin != NULL)
+        {
+            add_written_name(names, run_begin, text + i - run_begin);
+            run_begin = NULL;
+        }
+    }
+    if (run_begin != NULL) add_written_name(names, run_begin, text + length - run_begin);
+}
+
+//A stream only gets to apply a file scope rule to what comes after it,
+//rather than quietly differ from a file run it says so
+static void warn_late_stream_rules(StreamRules *carried, const EditState *edit, size_t first_new_rule,
+    const char *chunk, const char *chunk_end, uint32_t line_number)
+{
+    size_t rule_index = first_new_rule;
+    for (size_t i = 0; i <= edit->piece_count; i++)
+    {
+        const EditPiece *piece = i < edit->piece_count ? &edit->pieces[i] : NULL;
+        bool is_source = piece != NULL && piece->text >= chunk && piece->text < chunk_end;
+        for (; rule_index < edit->replace_rule_count; rule_index++)
+        {
+            const ReplaceRule *rule = &edit->replace_rules[rule_index];
+            const ReplaceScope *scope = &edit->replace_scopes[rule->scope_index];
+            if (scope->end != chunk_end) continue;
+            if (piece != NULL && (!is_source || piece->text < scope->begin)) break;
+            if (!has_written_name(&carried->written_names, rule)) continue;
+
+            const char *line_begin = scope->begin;
+            while (line_begin > chunk && line_begin[-1] != '\n') line_begin--;
+            fprintf(stderr, "WARNING[%u:%u] %.*s was already written out, streaming only applies this rule after it\n",
+                line_number + (uint32_t)count_line_breaks(chunk, scope->begin) + 1,
+                (uint32_t)(scope->begin - line_begin) + 1, (int)rule->target_length, rule->target);
+        }
+        if (piece != NULL) add_written_names(&carried->written_names, piece->text, piece->length);
+    }
+}
+
+static int run_stream_chunk(Worker *worker, const StreamRules *carried, char *chunk,
+    size_t chunk_size, bool is_partial, uint32_t line_number)
+{
+    EditState *edit = &worker->edit;
+    char saved_char = chunk[chunk_size];
+    chunk[chunk_size] = 0;
+
+    begin_lexer(worker, chunk, chunk_size, "<stdin>");
+    worker->lex.is_streaming = true;
+    worker->lex.is_partial = is_partial;
+    worker->lex.line_number = line_number;
+
+    if (carried->rule_count > 0)
+    {
+        ReplaceScope *scope = push_array_element(&edit->arena, edit->replace_scopes, edit->replace_scope_count, edit->replace_scope_capacity);
+        scope->begin = chunk;
+        scope->end = chunk + chunk_size;
+        for (size_t i = 0; i < carried->rule_count; i++)
+        {
+            *push_array_element(&edit->arena, edit->replace_rules, edit->replace_rule_count, edit->replace_rule_capacity) = carried->rules[i];
+        }
+    }
+
+    int jump_code = run_procedures(worker);
+    chunk[chunk_size] = saved_char;
+    return jump_code;
+}
+
+static int process_stream(Worker *worker, int input_fd, int output_fd, RunStats *stats)
+{
+    RunStats total_stats = {};
+    StreamRules carried = {};
+    EditState *edit = &worker->edit;
+
+    size_t window_size = 0;
+    size_t window_capacity = STREAM_CHUNK_SIZE + 1;
+    char *window = (char *)malloc(window_capacity);
+    size_t wanted_size = STREAM_CHUNK_SIZE;
+    uint32_t line_number = 0;
+    bool is_end_of_input = false;
+    int result = 0;
+
+    while (true)
+    {
+        if (wanted_size + 1 > window_capacity)
+        {
+            window_capacity = wanted_size + 1;
+            window = (char *)realloc(window, window_capacity);
+        }
+
+        double read_begin = get_seconds();
+        while (!is_end_of_input && window_size < wanted_size)
+        {
+            ssize_t count = read(input_fd, window + window_size, wanted_size - window_size);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0)
+            {
+                fprintf(stderr, "Could not read input\n");
+                result = 1;
+            }
+            if (count <= 0)
+            {
+                is_end_of_input = true;
+                break;
+            }
+            window_size += count;
+        }
+        total_stats.phase_seconds[StatsPhase_READ] += get_seconds() - read_begin;
+        if (result != 0) break;
+
+        size_t chunk_size = window_size;
+        if (!is_end_of_input)
+        {
+            while (chunk_size > 0 && window[chunk_size - 1] != '\n') chunk_size--;
+            if (chunk_size == 0)
+            {
+                wanted_size = window_size * 2;
+                continue;
+            }
+        }
+
+        size_t first_new_rule = carried.rule_count;
+        int jump_code = run_stream_chunk(worker, &carried, window, chunk_size, !is_end_of_input, line_number);
+        if (jump_code == LEXER_JUMP_NEED_MORE_INPUT)
+        {
+            size_t boundary = worker->lex.top_level_boundary - window;
+            reset_edit_state(edit);
+            if (boundary == 0)
+            {
+                wanted_size = window_size * 2;
+                continue;
+            }
+
+            chunk_size = boundary;
+            jump_code = run_stream_chunk(worker, &carried, window, chunk_size, false, line_number);
+        }
+
+        if (jump_code != 0)
+        {
+            reset_edit_state(edit);
+            result = 1;
+            break;
+        }
+
+        double write_begin = get_seconds();
+        if (!write_edit_pieces(output_fd, edit->pieces, edit->piece_count))
+        {
+            fprintf(stderr, "Could not write output\n");
+            reset_edit_state(edit);
+            result = 1;
+            break;
+        }
+        edit->stats.phase_seconds[StatsPhase_WRITE] += get_seconds() - write_begin;
+        accumulate_run_stats(&total_stats, &edit->stats);
+
+        warn_late_stream_rules(&carried, edit, first_new_rule, window, window + chunk_size, line_number);
+        carry_stream_rules(&carried, edit, first_new_rule, window + chunk_size);
+        line_number = worker->lex.line_number;
+        reset_edit_state(edit);
+
+        memmove(window, window + chunk_size, window_size - chunk_size);
+        window_size -= chunk_size;
+        if (is_end_of_input && window_size == 0) break;
+        wanted_size = window_size + STREAM_CHUNK_SIZE;
+    }
+
+    for (size_t i = 0; i < carried.rule_count; i++)
+    {
+        free((void *)carried.rules[i].target);
+    }
+    free(carried.rules);
+    free(carried.written_names.hashes);
+    free(carried.written_names.text);
+    free(window);
+    if (stats != NULL) *stats = total_stats;
+    return result;
+}
+
+//=========================================================
+// Batch mode
+//=========================================================
+
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} FileList;
+
+static void add_file(FileList *list, const char *path)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->paths = (char **)realloc(list->paths, sizeof(char *) * list->capacity);
+    }
+    list->paths[list->count++] = strdup(path);
+}
+
+static bool is_source_file(const char *path)
+{
+    static const char *SOURCE_EXTENSIONS[] = {
+        ".c", ".cc", ".cpp", ".cxx", ".h", ".hh", ".hpp", ".hxx", ".inl", ".ipp"
+    };
+
+    const char *extension = strrchr(path, '.');
+    if (extension == NULL) return false;
+    for (size_t i = 0; i < sizeof(SOURCE_EXTENSIONS) / sizeof(*SOURCE_EXTENSIONS); i++)
+    {
+        if (strcmp(extension, SOURCE_EXTENSIONS[i]) == 0) return true;
+    }
+    return false;
+}
+
+static bool join_directory_path(char *buffer, size_t buffer_size, const char *directory, const char *name)
+{
+    size_t directory_length = strlen(directory);
+    const char *separator = (directory_length > 0 && directory[directory_length - 1] == '/') ? "" : "/";
+    int length = snprintf(buffer, buffer_size, "%s%s%s", directory, separator, name);
+    if (length < 0 || (size_t)length >= buffer_size)
+    {
+        fprintf(stderr, "Path too long in %s: %s\n", directory, name);
+        return false;
+    }
+    return true;
+}
+
+//Links are never followed to directories, so a link back up the tree
+//can't hand the same file to the walk twice
+static bool get_directory_entry_type(const struct dirent *entry, const char *path,
+    bool *is_directory, bool *is_file)
+{
+    *is_directory = entry->d_type == DT_DIR;
+    *is_file = entry->d_type == DT_REG;
+    if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+    {
+        struct stat st;
+        if (lstat(path, &st) != 0) return false;
+        if (S_ISLNK(st.st_mode))
+        {
+            if (stat(path, &st) != 0) return false;
+            *is_directory = false;
+        }
+        else
+        {
+            *is_directory = S_ISDIR(st.st_mode);
+        }
+        *is_file = S_ISREG(st.st_mode);
+    }
+    return true;
+}
+
+static void collect_directory(FileList *list, const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Could not open directory %s\n", directory);
+        return;
+    }
+
+    char path[4096];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.') continue;
+        if (!join_directory_path(path, sizeof(path), directory, entry->d_name)) continue;
+
+        bool is_directory, is_file;
+        if (!get_directory_entry_type(entry, path, &is_directory, &is_file)) continue;
+        if (is_directory)
+        {
+            collect_directory(list, path);
+        }
+        else if (is_file && is_source_file(path))
+        {
+            add_file(list, path);
+        }
+    }
+    closedir(dir);
+}
+
+static void collect_path(FileList *list, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        collect_directory(list, path);
+    }
+    else
+    {
+        add_file(list, path);
+    }
+}
+
+static void collect_argument(FileList *list, const char *argument)
+{
+    if (argument[0] == '@')
+    {
+        FILE *file = fopen(argument + 1, "rb");
+        if (file == NULL)
+        {
+            fprintf(stderr, "Could not open file list %s\n", argument + 1);
+            return;
+        }
+
+        char line[4096];
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            size_t length = strlen(line);
+            while (length > 0 && is_whitespace(line[length - 1]))
+            {
+                line[--length] = 0;
+            }
+            if (length > 0) collect_path(list, line);
+        }
+        fclose(file);
+    }
+    else if (strpbrk(argument, "*?[") != NULL)
+    {
+        glob_t matches;
+        if (glob(argument, 0, NULL, &matches) == 0)
+        {
+            for (size_t i = 0; i < matches.gl_pathc; i++)
+            {
+                collect_path(list, matches.gl_pathv[i]);
+            }
+        }
+        globfree(&matches);
+    }
+    else
+    {
+        collect_path(list, argument);
+    }
+}
+
+typedef struct {
+    FileList *files;
+    size_t next_file;
+    size_t failed_count;
+
+    size_t split_thread_count;
+    Journal *journal;
+    bool is_diff;
+    size_t pending_count;
+    SkipCache *skip_cache;
+    const ScriptPlan *plan;
+
+    StatsFormat stats_format;
+    pthread_mutex_t stats_mutex;
+    RunStats total_stats;
+} WorkQueue;
+
+static void *worker_thread_proc(void *userdata)
+{
+    WorkQueue *queue = (WorkQueue *)userdata;
+    Worker *worker = (Worker *)calloc(1, sizeof(Worker));
+    worker->split_thread_count = queue->split_thread_count;
+    worker->journal = queue->journal;
+    worker->is_diff = queue->is_diff;
+    worker->skip_cache = queue->skip_cache;
+    worker->plan = queue->plan;
+    RunStats stats;
+    RunStats *run_stats = queue->stats_format != StatsFormat_NONE ? &stats : NULL;
+    RunStats total_stats = {};
+
+    while (true)
+    {
+        size_t index = __atomic_fetch_add(&queue->next_file, 1, __ATOMIC_RELAXED);
+        if (index >= queue->files->count) break;
+        if (process_file(worker, queue->files->paths[index], NULL, run_stats) != 0)
+        {
+            __atomic_fetch_add(&queue->failed_count, 1, __ATOMIC_RELAXED);
+        }
+        else if (run_stats != NULL)
+        {
+            print_run_stats(queue->files->paths[index], run_stats, queue->stats_format);
+            accumulate_run_stats(&total_stats, run_stats);
+        }
+    }
+
+    __atomic_fetch_add(&queue->pending_count, worker->pending_count, __ATOMIC_RELAXED);
+    if (run_stats != NULL)
+    {
+        pthread_mutex_lock(&queue->stats_mutex);
+        accumulate_run_stats(&queue->total_stats, &total_stats);
+        pthread_mutex_unlock(&queue->stats_mutex);
+    }
+
+    free_worker(worker);
+    free(worker);
+    return NULL;
+}
+
+static size_t run_worker_pool(FileList *files, size_t thread_count, StatsFormat stats_format,
+    Journal *journal, SkipCache *skip_cache, const ScriptPlan *plan, bool is_diff, size_t *pending_count)
+{
+    WorkQueue queue = {};
+    queue.files = files;
+    queue.journal = journal;
+    queue.skip_cache = skip_cache;
+    queue.plan = plan;
+    queue.is_diff = is_diff;
+    queue.stats_format = stats_format;
+    pthread_mutex_init(&queue.stats_mutex, NULL);
+    double begin = get_seconds();
+
+    queue.split_thread_count = files->count > 0 ? thread_count / files->count : 1;
+    if (thread_count > files->count) thread_count = files->count;
+    if (thread_count <= 1)
+    {
+        worker_thread_proc(&queue);
+    }
+    else
+    {
+        pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * thread_count);
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            pthread_create(&threads[i], NULL, worker_thread_proc, &queue);
+        }
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+
+    if (stats_format != StatsFormat_NONE && (files->count > 1 || stats_format == StatsFormat_JSON))
+    {
+        print_total_stats(&queue.total_stats, files->count, queue.failed_count,
+            get_seconds() - begin, stats_format);
+    }
+    pthread_mutex_destroy(&queue.stats_mutex);
+    if (pending_count != NULL) *pending_count = queue.pending_count;
+    return queue.failed_count;
+}
+
+//=========================================================
+// Identifier index
+//=========================================================
+
+//Any run of identifier chars counts, the same runs the replacement engine
+//looks in, so names in strings and comments and the x1f of 0x1f do too
+
+#define IDENTIFIER_INDEX_FILENAME ".ductus_index"
+#define IDENTIFIER_INDEX_MAGIC "DUCTUSI1"
+#define IDENTIFIER_INDEX_MAGIC_SIZE 8
+
+#define INDEXED_FILE_HAS_PROCEDURES (1 << 0)
+#define INDEXED_FILE_NOT_INDEXED    (1 << 1)   //Unreadable or too big for 32 bit offsets
+
+//Everything is a multiple of 8 bytes so the arrays can be used straight
+//out of the mapping
+typedef struct {
+    char magic[IDENTIFIER_INDEX_MAGIC_SIZE];
+    uint64_t file_count;
+    uint64_t name_count;
+    uint64_t position_count;
+    uint64_t text_size;
+} IndexHeader;
+
+typedef struct {
+    uint64_t path_offset;          //Into the text
+    uint32_t path_length;
+    uint32_t flags;
+    FileSignature signature;       //Of the file as it was indexed
+} IndexedFile;
+
+typedef struct {
+    uint64_t text_offset;
+    uint32_t length;
+    uint32_t position_count;
+    uint64_t first_position;
+} IndexedName;
+
+typedef struct {
+    uint32_t file;
+    uint32_t offset;
+} IndexedPosition;
+
+typedef struct {
+    MappedFile mapped;
+    const IndexHeader *header;
+    const IndexedFile *files;
+    const IndexedName *names;
+    const IndexedPosition *positions;
+    const char *text;
+} IdentifierIndex;
+
+typedef struct {
+    uint32_t name;                 //Into the table of the shard
+    uint32_t offset;
+} IndexPosting;
+
+typedef struct {
+    FileList *files;
+    size_t next_file;
+    IndexedFile *indexed_files;
+    uint32_t *file_shards;
+    size_t *first_postings;        //Of each file, in its shard
+    size_t *end_postings;
+} IndexBuild;
+
+typedef struct {
+    IndexBuild *build;
+    uint32_t index;
+    MemoryArena arena;
+    IdentifierTable table;
+    IndexPosting *postings;
+    size_t posting_count;
+    size_t posting_capacity;
+} IndexShard;
+
+//A file run for nothing is better than one skipped
+static bool has_procedure(const char *data, size_t size)
+{
+    const char *end = data + size;
+    const char *cursor = (const char *)memchr(data, '#', size);
+    while (cursor != NULL)
+    {
+        const char *name_end;
+        if (lex_procedure_name(cursor + 1, end, &name_end) != TokenType_POUND) return true;
+        cursor = (const char *)memchr(cursor + 1, '#', end - cursor - 1);
+    }
+    return false;
+}
+
+static void *index_thread_proc(void *userdata)
+{
+    IndexShard *shard = (IndexShard *)userdata;
+    IndexBuild *build = shard->build;
+    while (true)
+    {
+        size_t index = __atomic_fetch_add(&build->next_file, 1, __ATOMIC_RELAXED);
+        if (index >= build->files->count) break;
+
+        IndexedFile *indexed = &build->indexed_files[index];
+        build->file_shards[index] = shard->index;
+        build->first_postings[index] = shard->posting_count;
+        build->end_postings[index] = shard->posting_count;
+
+        MappedFile file;
+        if (!map_file(build->files->paths[index], &file))
+        {
+            fprintf(stderr, "Could not open file %s\n", build->files->paths[index]);
+            indexed->flags = INDEXED_FILE_NOT_INDEXED;
+            continue;
+        }
+        indexed->signature = file.signature;
+        if (file.size > UINT32_MAX)
+        {
+            indexed->flags = INDEXED_FILE_NOT_INDEXED;
+            unmap_file(&file);
+            continue;
+        }
+        if (has_procedure(file.data, file.size)) indexed->flags |= INDEXED_FILE_HAS_PROCEDURES;
+
+        const char *cursor = file.data;
+        const char *end = file.data + file.size;
+        while (cursor < end)
+        {
+            const char *run_begin = find_identifier_char(cursor, end);
+            const char *run_end = skip_identifier_chars(run_begin, end);
+            if (run_begin == run_end) break;
+            cursor = run_end;
+
+            IndexPosting *posting = push_array_element((MemoryArena *)NULL, shard->postings, shard->posting_count, shard->posting_capacity);
+            posting->name = intern_identifier(&shard->arena, &shard->table, run_begin, run_end - run_begin);
+            posting->offset = (uint32_t)(run_begin - file.data);
+        }
+        build->end_postings[index] = shard->posting_count;
+        unmap_file(&file);
+    }
+    return NULL;
+}
+
+//Positions go in one file after another, so within each name they come
+//out in file order without any sorting
+static int build_identifier_index(FileList *files, size_t thread_count)
+{
+    if (files->count > UINT32_MAX)
+    {
+        fprintf(stderr, "Too many files to index\n");
+        return 1;
+    }
+    if (thread_count > files->count) thread_count = files->count;
+    if (thread_count < 1) thread_count = 1;
+
+    IndexBuild build = {};
+    build.files = files;
+    build.indexed_files = (IndexedFile *)calloc(files->count + 1, sizeof(IndexedFile));
+    build.file_shards = (uint32_t *)calloc(files->count + 1, sizeof(uint32_t));
+    build.first_postings = (size_t *)calloc(files->count + 1, sizeof(size_t));
+    build.end_postings = (size_t *)calloc(files->count + 1, sizeof(size_t));
+
+    IndexShard *shards = (IndexShard *)calloc(thread_count, sizeof(IndexShard));
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * thread_count);
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        shards[i].build = &build;
+        shards[i].index = (uint32_t)i;
+        if (i > 0) pthread_create(&threads[i], NULL, index_thread_proc, &shards[i]);
+    }
+    index_thread_proc(&shards[0]);
+    for (size_t i = 1; i < thread_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    MemoryArena arena = {};
+    IdentifierTable table = {};
+    uint32_t **name_maps = (uint32_t **)malloc(sizeof(uint32_t *) * thread_count);
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        const IdentifierTable *shard_table = &shards[i].table;
+        name_maps[i] = (uint32_t *)arena_allocate(&arena, sizeof(uint32_t) * (shard_table->name_count + 1));
+        for (size_t n = 0; n < shard_table->name_count; n++)
+        {
+            const IdentifierName *name = &shard_table->names[n];
+            name_maps[i][n] = intern_identifier(&arena, &table, name->text, name->length);
+        }
+    }
+
+    size_t position_count = 0;
+    uint64_t *first_positions = (uint64_t *)calloc(table.name_count + 1, sizeof(uint64_t));
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        for (size_t n = 0; n < shards[i].posting_count; n++)
+        {
+            first_positions[name_maps[i][shards[i].postings[n].name] + 1]++;
+        }
+        position_count += shards[i].posting_count;
+    }
+    for (size_t i = 0; i < table.name_count; i++) first_positions[i + 1] += first_positions[i];
+
+    uint64_t *next_positions = (uint64_t *)malloc(sizeof(uint64_t) * (table.name_count + 1));
+    memcpy(next_positions, first_positions, sizeof(uint64_t) * (table.name_count + 1));
+    IndexedPosition *positions = (IndexedPosition *)malloc(sizeof(IndexedPosition) * (position_count + 1));
+    for (size_t i = 0; i < files->count; i++)
+    {
+        const IndexShard *shard = &shards[build.file_shards[i]];
+        const uint32_t *name_map = name_maps[build.file_shards[i]];
+        for (size_t n = build.first_postings[i]; n < build.end_postings[i]; n++)
+        {
+            IndexedPosition *position = &positions[next_positions[name_map[shard->postings[n].name]]++];
+            position->file = (uint32_t)i;
+            position->offset = shard->postings[n].offset;
+        }
+    }
+
+    SortedName *sorted_names = (SortedName *)malloc(sizeof(SortedName) * (table.name_count + 1));
+    size_t text_size = 0;
+    for (uint32_t i = 0; i < table.name_count; i++)
+    {
+        sorted_names[i].text = table.names[i].text;
+        sorted_names[i].length = table.names[i].length;
+        sorted_names[i].name = i;
+        text_size += table.names[i].length;
+    }
+    qsort(sorted_names, table.name_count, sizeof(SortedName), compare_sorted_names);
+    for (size_t i = 0; i < files->count; i++) text_size += strlen(files->paths[i]);
+
+    char *text = (char *)malloc(text_size + 1);
+    size_t text_used = 0;
+    IndexedName *names = (IndexedName *)malloc(sizeof(IndexedName) * (table.name_count + 1));
+    for (size_t i = 0; i < table.name_count; i++)
+    {
+        const SortedName *sorted = &sorted_names[i];
+        names[i].text_offset = text_used;
+        names[i].length = sorted->length;
+        names[i].first_position = first_positions[sorted->name];
+        names[i].position_count = (uint32_t)(first_positions[sorted->name + 1] - first_positions[sorted->name]);
+        memcpy(text + text_used, sorted->text, sorted->length);
+        text_used += sorted->length;
+    }
+    for (size_t i = 0; i < files->count; i++)
+    {
+        size_t length = strlen(files->paths[i]);
+        build.indexed_files[i].path_offset = text_used;
+        build.indexed_files[i].path_length = (uint32_t)length;
+        memcpy(text + text_used, files->paths[i], length);
+        text_used += length;
+    }
+
+    IndexHeader header = {};
+    memcpy(header.magic, IDENTIFIER_INDEX_MAGIC, IDENTIFIER_INDEX_MAGIC_SIZE);
+    header.file_count = files->count;
+    header.name_count = table.name_count;
+    header.position_count = position_count;
+    header.text_size = text_size;
+
+    EditPiece pieces[5];
+    pieces[0].text = (const char *)&header;
+    pieces[0].length = sizeof(IndexHeader);
+    pieces[1].text = (const char *)build.indexed_files;
+    pieces[1].length = sizeof(IndexedFile) * files->count;
+    pieces[2].text = (const char *)names;
+    pieces[2].length = sizeof(IndexedName) * table.name_count;
+    pieces[3].text = (const char *)positions;
+    pieces[3].length = sizeof(IndexedPosition) * position_count;
+    pieces[4].text = text;
+    pieces[4].length = text_size;
+    int result = 0;
+    if (!write_file_atomic(IDENTIFIER_INDEX_FILENAME, 0644, pieces, 5, NULL))
+    {
+        fprintf(stderr, "Could not write %s\n", IDENTIFIER_INDEX_FILENAME);
+        result = 1;
+    }
+    else
+    {
+        printf("Indexed %zu files, %zu names, %zu positions\n", files->count, table.name_count, position_count);
+    }
+
+    //Not freed, the process is about to exit
+    return result;
+}
+
+static bool load_identifier_index(IdentifierIndex *index)
+{
+    memset(index, 0, sizeof(IdentifierIndex));
+    if (!map_file(IDENTIFIER_INDEX_FILENAME, &index->mapped)) return false;
+
+    const MappedFile *mapped = &index->mapped;
+    const IndexHeader *header = (const IndexHeader *)mapped->data;
+    bool is_valid = mapped->size >= sizeof(IndexHeader) &&
+        memcmp(header->magic, IDENTIFIER_INDEX_MAGIC, IDENTIFIER_INDEX_MAGIC_SIZE) == 0 &&
+        header->file_count < UINT32_MAX && header->name_count < UINT32_MAX &&
+        header->position_count <= mapped->size / sizeof(IndexedPosition) && header->text_size <= mapped->size &&
+        mapped->size == sizeof(IndexHeader) + header->file_count * sizeof(IndexedFile) +
+            header->name_count * sizeof(IndexedName) + header->position_count * sizeof(IndexedPosition) + header->text_size;
+    if (is_valid)
+    {
+        index->header = header;
+        index->files = (const IndexedFile *)(header + 1);
+        index->names = (const IndexedName *)(index->files + header->file_count);
+        index->positions = (const IndexedPosition *)(index->names + header->name_count);
+        index->text = (const char *)(index->positions + header->position_count);
+        for (size_t i = 0; is_valid && i < header->file_count; i++)
+        {
+            is_valid = index->files[i].path_offset + index->files[i].path_length <= header->text_size;
+        }
+        for (size_t i = 0; is_valid && i < header->name_count; i++)
+        {
+            const IndexedName *name = &index->names[i];
+            is_valid = name->text_offset + name->length <= header->text_size &&
+                name->first_position + name->position_count <= header->position_count;
+        }
+        for (size_t i = 0; is_valid && i < header->position_count; i++)
+        {
+            is_valid = index->positions[i].file < header->file_count;
+        }
+    }
+
+    if (!is_valid)
+    {
+        fprintf(stderr, "%s is damaged, ignoring it\n", IDENTIFIER_INDEX_FILENAME);
+        unmap_file(&index->mapped);
+        return false;
+    }
+    return true;
+}
+
+static const IndexedName *find_indexed_name(const IdentifierIndex *index, const char *text, size_t length)
+{
+    SortedName key = { text, (uint32_t)length, 0 };
+    size_t low = 0, high = index->header->name_count;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        const IndexedName *name = &index->names[middle];
+        SortedName entry = { index->text + name->text_offset, name->length, 0 };
+        int order = compare_sorted_names(&entry, &key);
+        if (order == 0) return name;
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+    return NULL;
+}
+
+static void select_indexed_files(const IdentifierIndex *index, const ScriptPlan *plan, FileList *files)
+{
+    size_t file_count = index->header->file_count;
+    uint8_t *is_selected = (uint8_t *)calloc(file_count + 1, 1);
+    for (size_t i = 0; i < file_count; i++)
+    {
+        is_selected[i] = (index->files[i].flags & (INDEXED_FILE_HAS_PROCEDURES | INDEXED_FILE_NOT_INDEXED)) != 0;
+    }
+
+    MemoryArena arena = {};
+    IdentifierTable operator_targets = {};
+    for (size_t i = 0; i < plan->rule_count; i++)
+    {
+        const ReplaceRule *rule = &plan->rules[i];
+        if (rule->kind == ReplaceKind_TO_POINTER || rule->kind == ReplaceKind_TO_VALUE)
+        {
+            intern_identifier(&arena, &operator_targets, rule->target, rule->target_length);
+        }
+    }
+
+    const ReplaceAutomaton *automaton = &plan->rule_set.automaton;
+    for (size_t i = 0; i < index->header->name_count; i++)
+    {
+        const IndexedName *name = &index->names[i];
+        const char *text = index->text + name->text_offset;
+        bool is_hit = find_identifier(&operator_targets, text, name->length) != NAME_NONE;
+        int32_t state = 0;
+        for (size_t n = 0; n < name->length && !is_hit && plan->rule_set.rule_count > 0; n++)
+        {
+            state = automaton->transitions[state * IDENTIFIER_CHAR_CLASS_COUNT + identifier_char_class(text[n])];
+            int32_t output = automaton->rule_index[state] != -1 ? state : automaton->output_link[state];
+            for (; output != -1 && !is_hit; output = automaton->output_link[output])
+            {
+                size_t target_length = plan->rules[automaton->rule_index[output]].target_length;
+                for (uint32_t r = plan->rule_set.first_state_rule[output]; r < plan->rule_set.first_state_rule[output + 1]; r++)
+                {
+                    if (plan->rules[plan->rule_set.state_rules[r]].kind == ReplaceKind_TEXT ||
+                        target_length == name->length)
+                    {
+                        is_hit = true;
+                    }
+                }
+            }
+        }
+        if (!is_hit) continue;
+
+        for (size_t n = 0; n < name->position_count; n++)
+        {
+            is_selected[index->positions[name->first_position + n].file] = 1;
+        }
+    }
+
+    IdentifierTable paths = {};
+    for (size_t i = 0; i < file_count; i++)
+    {
+        intern_identifier(&arena, &paths, index->text + index->files[i].path_offset, index->files[i].path_length);
+    }
+
+    size_t kept_count = 0;
+    for (size_t i = 0; i < files->count; i++)
+    {
+        char *path = files->paths[i];
+        uint32_t file = find_identifier(&paths, path, strlen(path));
+        bool is_kept = file == NAME_NONE || is_selected[file];
+        if (!is_kept)
+        {
+            struct stat st;
+            FileSignature signature = {};
+            if (stat(path, &st) == 0) signature = get_file_signature(&st);
+            is_kept = !signatures_match(&signature, &index->files[file].signature);
+        }
+
+        if (is_kept) files->paths[kept_count++] = path;
+        else free(path);
+    }
+    files->count = kept_count;
+
+    free(is_selected);
+    free_arena(&arena);
+}
+
+static int run_find_command(const char *text)
+{
+    IdentifierIndex index;
+    if (!load_identifier_index(&index))
+    {
+        fprintf(stderr, "No index in this directory, build one with ductus --index\n");
+        return 1;
+    }
+
+    const IndexedName *name = find_indexed_name(&index, text, strlen(text));
+    size_t n = 0;
+    while (name != NULL && n < name->position_count)
+    {
+        uint32_t file_index = index.positions[name->first_position + n].file;
+        const IndexedFile *indexed = &index.files[file_index];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s", (int)indexed->path_length, index.text + indexed->path_offset);
+
+        MappedFile file;
+        bool is_current = map_file(path, &file);
+        if (is_current && !signatures_match(&file.signature, &indexed->signature))
+        {
+            unmap_file(&file);
+            is_current = false;
+        }
+        if (!is_current) fprintf(stderr, "%s changed since it was indexed\n", path);
+
+        size_t line_number = 1;
+        const char *counted = is_current ? file.data : NULL;
+        for (; n < name->position_count && index.positions[name->first_position + n].file == file_index; n++)
+        {
+            if (!is_current) continue;
+            const char *position = file.data + index.positions[name->first_position + n].offset;
+            line_number += count_line_breaks(counted, position);
+            counted = position;
+            const char *line_begin = find_diff_line_begin(file.data, position);
+            const char *line_end = find_line_break(position, file.data + file.size);
+            printf("%s:%zu:%zu:%.*s\n", path, line_number, (size_t)(position - line_begin) + 1,
+                (int)(line_end - line_begin), line_begin);
+        }
+        if (is_current) unmap_file(&file);
+    }
+
+    bool is_found = name != NULL;
+    unmap_file(&index.mapped);
+    return is_found ? 0 : 1;
+}
+
+//=========================================================
+// Line index
+//=========================================================
+
+//The state at the start of a line only depends on the text before it, so
+//a change only rescans from its first byte to the first line after it
+//that starts in the same state it did before
+
+#define LINE_HAS_REPLACE              (1 << 0)
+#define LINE_HAS_FOR                  (1 << 1)
+#define LINE_HAS_FILE_SCOPE_DIRECTIVE (1 << 2)
+
+typedef struct {
+    size_t offset;
+    uint32_t depth;
+    uint16_t flags;
+    bool starts_in_comment;
+} LineEntry;
+
+typedef struct {
+    char *text;             //Copy of the version of the file the index describes
+    size_t length;
+    size_t text_capacity;
+
+    LineEntry *lines;
+    size_t line_count;
+    size_t line_capacity;
+
+    LineEntry *scanned;     //Lines rescanned by the last update
+    size_t scanned_count;
+    size_t scanned_capacity;
+
+    size_t directive_line_count;
+} LineIndex;
+
+static uint16_t get_directive_flags(const char *text, const char *end, const char *cursor,
+    const char *limit, uint32_t depth)
+{
+    uint16_t flags = 0;
+    while (cursor < limit && (cursor = (const char *)memchr(cursor, '#', limit - cursor)) != NULL)
+    {
+        const char *token_end;
+        TokenType type = peek_token_type(text, end, cursor, &token_end);
+        if (is_identifier_directive(type))
+        {
+            flags |= LINE_HAS_REPLACE;
+        }
+        else if (type == TokenType_POUND_FOR)
+        {
+            flags |= LINE_HAS_FOR;
+        }
+        cursor = token_end;
+    }
+    if (flags != 0 && depth == 0) flags |= LINE_HAS_FILE_SCOPE_DIRECTIVE;
+    return flags;
+}
+
+//parse_block also runs directives in a literal or a comment, those are
+//flagged as if at file scope so the whole file runs
+static const char *scan_line(const char *text, const char *end, const char *cursor,
+    uint32_t *depth, bool *in_comment, uint16_t *flags)
+{
+    const char *line_end = find_line_break(cursor, end);
+    const char *next_line = line_end;
+    if (next_line < end) next_line += (*next_line == '\r' && next_line[1] == '\n') ? 2 : 1;
+
+    *flags = 0;
+    if (*in_comment)
+    {
+        const char *comment_end = find_block_comment_end(cursor, line_end);
+        *flags |= get_directive_flags(text, end, cursor, comment_end ? comment_end : line_end, 0);
+        if (comment_end == NULL) return next_line;
+        *in_comment = false;
+        cursor = comment_end;
+    }
+
+    while (true)
+    {
+        cursor = find_scope_char(cursor, line_end);
+        if (cursor >= line_end) return next_line;
+
+        const char *ignored_end = NULL;
+        switch (*cursor)
+        {
+            case '{':
+            {
+                (*depth)++;
+                cursor++;
+            } break;
+
+            case '}':
+            {
+                if (*depth > 0) (*depth)--;
+                cursor++;
+            } break;
+
+            case '"':
+            {
+                ignored_end = skip_quoted_text(cursor, line_end);
+            } break;
+
+            case '\'':
+            {
+                if (is_digit_separator(text, cursor)) cursor++;
+                else ignored_end = skip_quoted_text(cursor, line_end);
+            } break;
+
+            case '/':
+            {
+                if (cursor[1] == '/')
+                {
+                    ignored_end = line_end;
+                }
+                else if (cursor[1] == '*')
+                {
+                    ignored_end = find_block_comment_end(cursor + 2, line_end);
+                    if (ignored_end == NULL)
+                    {
+                        *in_comment = true;
+                        ignored_end = line_end;
+                    }
+                }
+                else
+                {
+                    cursor++;
+                }
+            } break;
+
+            case '#':
+            {
+                *flags |= get_directive_flags(text, end, cursor, cursor + 1, *depth);
+                peek_token_type(text, end, cursor, &cursor);
+            } break;
+        }
+
+        if (ignored_end != NULL)
+        {
+            *flags |= get_directive_flags(text, end, cursor, ignored_end, 0);
+            cursor = ignored_end;
+        }
+    }
+}
+
+static size_t common_prefix_length(const char *a, const char *b, size_t length)
+{
+    size_t result = 0;
+    while (result + 4096 <= length && memcmp(a + result, b + result, 4096) == 0) result += 4096;
+    while (result < length && a[result] == b[result]) result++;
+    return result;
+}
+
+static size_t common_suffix_length(const char *a_end, const char *b_end, size_t length)
+{
+    size_t result = 0;
+    while (result + 4096 <= length && memcmp(a_end - result - 4096, b_end - result - 4096, 4096) == 0) result += 4096;
+    while (result < length && a_end[-1 - (ptrdiff_t)result] == b_end[-1 - (ptrdiff_t)result]) result++;
+    return result;
+}
+
+static size_t find_line(const LineIndex *index, size_t offset)
+{
+    size_t low = 0;
+    size_t high = index->line_count;
+    while (high - low > 1)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (index->lines[middle].offset <= offset) low = middle;
+        else high = middle;
+    }
+    return low;
+}
+
+static void update_line_index(LineIndex *index, const char *text, size_t length)
+{
+    size_t old_length = index->length;
+    size_t common_length = old_length < length ? old_length : length;
+    size_t prefix = index->line_count > 0 ? common_prefix_length(index->text, text, common_length) : 0;
+    if (index->line_count > 0 && prefix == old_length && prefix == length) return;
+    size_t suffix = index->line_count > 0 ? common_suffix_length(index->text + old_length,
+        text + length, common_length - prefix) : 0;
+    size_t change_end = length - suffix;
+
+    size_t first_line = 0;
+    uint32_t depth = 0;
+    bool in_comment = false;
+    if (index->line_count > 0)
+    {
+        //A line starting right at the change may not start there anymore, a lone
+        //'\r' before it becomes a "\r\n" when a '\n' is inserted
+        first_line = find_line(index, prefix);
+        if (first_line > 0 && index->lines[first_line].offset == prefix) first_line--;
+        depth = index->lines[first_line].depth;
+        in_comment = index->lines[first_line].starts_in_comment;
+    }
+
+    size_t resync_line = index->line_count;
+    size_t old_line = first_line + 1;
+    size_t offset = first_line < index->line_count ? index->lines[first_line].offset : 0;
+    const char *end = text + length;
+    index->scanned_count = 0;
+    while (offset < length)
+    {
+        LineEntry *entry = push_array_element(NULL, index->scanned, index->scanned_count, index->scanned_capacity);
+        entry->offset = offset;
+        entry->depth = depth;
+        entry->starts_in_comment = in_comment;
+        offset = scan_line(text, end, text + offset, &depth, &in_comment, &entry->flags) - text;
+
+        if (offset > change_end && offset < length)
+        {
+            size_t old_offset = offset - length + old_length;
+            while (old_line < index->line_count && index->lines[old_line].offset < old_offset) old_line++;
+            if (old_line < index->line_count && index->lines[old_line].offset == old_offset &&
+                index->lines[old_line].depth == depth && index->lines[old_line].starts_in_comment == in_comment)
+            {
+                resync_line = old_line;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = first_line; i < resync_line; i++)
+    {
+        if (index->lines[i].flags != 0) index->directive_line_count--;
+    }
+    for (size_t i = 0; i < index->scanned_count; i++)
+    {
+        if (index->scanned[i].flags != 0) index->directive_line_count++;
+    }
+
+    size_t kept_count = index->line_count - resync_line;
+    size_t new_count = first_line + index->scanned_count + kept_count;
+    if (new_count > index->line_capacity)
+    {
+        index->line_capacity = new_count + new_count / 2;
+        index->lines = (LineEntry *)realloc(index->lines, sizeof(LineEntry) * index->line_capacity);
+    }
+    memmove(index->lines + first_line + index->scanned_count, index->lines + resync_line, sizeof(LineEntry) * kept_count);
+    memcpy(index->lines + first_line, index->scanned, sizeof(LineEntry) * index->scanned_count);
+    for (size_t i = new_count - kept_count; i < new_count; i++)
+    {
+        index->lines[i].offset = index->lines[i].offset - old_length + length;
+    }
+    index->line_count = new_count;
+
+    if (length + 1 > index->text_capacity)
+    {
+        index->text_capacity = length + 1 + length / 2;
+        index->text = (char *)realloc(index->text, index->text_capacity);
+    }
+    memcpy(index->text, text, length);
+    index->text[length] = 0;
+    index->length = length;
+}
+
+//#r at file scope reaches the whole file and the line index doesn't skip
+//#fl bodies, either one means the whole file has to run
+static bool find_directive_span(const LineIndex *index, size_t *span_begin,
+    size_t *span_end, size_t *span_first_line)
+{
+    size_t first = index->line_count;
+    size_t last = 0;
+    for (size_t i = 0; i < index->line_count; i++)
+    {
+        uint32_t flags = index->lines[i].flags;
+        if (flags == 0) continue;
+        if (flags & (LINE_HAS_FOR | LINE_HAS_FILE_SCOPE_DIRECTIVE)) return false;
+        if (first == index->line_count) first = i;
+        last = i;
+    }
+    if (first == index->line_count) return false;
+
+    while (index->lines[first].depth != 0 || index->lines[first].starts_in_comment) first--;
+    last++;
+    while (last < index->line_count &&
+        (index->lines[last].depth != 0 || index->lines[last].starts_in_comment)) last++;
+
+    *span_begin = index->lines[first].offset;
+    *span_end = last < index->line_count ? index->lines[last].offset : index->length;
+    *span_first_line = first;
+    return true;
+}
+
+//=========================================================
+// Watch mode
+//=========================================================
+
+//Rewriting a file triggers events of its own, those are recognized by the
+//signature ductus recorded for the file and dropped
+
+//A save often touches a file more than once
+#define WATCH_SETTLE_MS 2
+#define WATCH_MAX_DELAY_MS 100
+
+typedef struct {
+    char *path;
+    FileSignature signature;
+    LineIndex index;
+} WatchedFile;
+
+typedef struct {
+    int inotify_fd;
+    Worker *worker;
+
+    WatchedFile *files;    //Open addressed on the hash of the path
+    size_t file_count;
+    size_t file_capacity;
+
+    char **directories;    //Indexed by watch descriptor
+    size_t directory_capacity;
+
+    FileList pending;
+
+    char *span;             //Copy of the text the procedures run over
+    size_t span_capacity;
+} WatchState;
+
+static inline uint64_t hash_string(const char *string)
+{
+    uint64_t hash = 14695981039346656037ull;
+    while (*string)
+    {
+        hash = (hash ^ (uint8_t)*string++) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static WatchedFile *find_watched_file(WatchState *state, const char *path, bool *is_new)
+{
+    if ((state->file_count + 1) * 2 > state->file_capacity)
+    {
+        WatchedFile *old_files = state->files;
+        size_t old_capacity = state->file_capacity;
+        state->file_capacity = old_capacity ? old_capacity * 2 : 1024;
+        state->files = (WatchedFile *)calloc(state->file_capacity, sizeof(WatchedFile));
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_files[i].path == NULL) continue;
+            size_t index = hash_string(old_files[i].path) & (state->file_capacity - 1);
+            while (state->files[index].path != NULL) index = (index + 1) & (state->file_capacity - 1);
+            state->files[index] = old_files[i];
+        }
+        free(old_files);
+    }
+
+    size_t index = hash_string(path) & (state->file_capacity - 1);
+    while (state->files[index].path != NULL)
+    {
+        if (strcmp(state->files[index].path, path) == 0)
+        {
+            *is_new = false;
+            return &state->files[index];
+        }
+        index = (index + 1) & (state->file_capacity - 1);
+    }
+
+    *is_new = true;
+    state->files[index].path = strdup(path);
+    state->file_count++;
+    return &state->files[index];
+}
+
+//Files found along the way may have been written before the watch existed
+static void watch_directory(WatchState *state, const char *directory)
+{
+    int wd = inotify_add_watch(state->inotify_fd, directory,
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (wd < 0)
+    {
+        fprintf(stderr, "Could not watch directory %s\n", directory);
+        return;
+    }
+
+    if ((size_t)wd >= state->directory_capacity)
+    {
+        size_t new_capacity = state->directory_capacity ? state->directory_capacity : 64;
+        while (new_capacity <= (size_t)wd) new_capacity *= 2;
+        state->directories = (char **)realloc(state->directories, sizeof(char *) * new_capacity);
+        memset(state->directories + state->directory_capacity, 0,
+            sizeof(char *) * (new_capacity - state->directory_capacity));
+        state->directory_capacity = new_capacity;
+    }
+    free(state->directories[wd]);
+    state->directories[wd] = strdup(directory);
+
+    DIR *dir = opendir(directory);
+    if (dir == NULL) return;
+
+    char path[4096];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.') continue;
+        if (!join_directory_path(path, sizeof(path), directory, entry->d_name)) continue;
+
+        bool is_directory, is_file;
+        if (!get_directory_entry_type(entry, path, &is_directory, &is_file)) continue;
+        if (is_directory)
+        {
+            watch_directory(state, path);
+        }
+        else if (is_file && is_source_file(path))
+        {
+            add_file(&state->pending, path);
+        }
+    }
+    closedir(dir);
+}
+
+static int process_indexed_file(WatchState *state, WatchedFile *file, const char *path)
+{
+    MappedFile mapped;
+    if (!map_file(path, &mapped))
+    {
+        fprintf(stderr, "Could not open file %s\n", path);
+        return 1;
+    }
+
+    LineIndex *index = &file->index;
+    update_line_index(index, mapped.data, mapped.size);
+    file->signature = mapped.signature;
+    if (index->directive_line_count == 0)
+    {
+        unmap_file(&mapped);
+        return 0;
+    }
+
+    size_t span_begin = 0;
+    size_t span_end = mapped.size;
+    size_t span_first_line = 0;
+    const char *span = mapped.data;
+    if (find_directive_span(index, &span_begin, &span_end, &span_first_line))
+    {
+        size_t span_length = span_end - span_begin;
+        if (span_length + 1 > state->span_capacity)
+        {
+            state->span_capacity = span_length + 1 + span_length / 2;
+            state->span = (char *)realloc(state->span, state->span_capacity);
+        }
+        memcpy(state->span, mapped.data + span_begin, span_length);
+        state->span[span_length] = 0;
+        span = state->span;
+    }
+
+    Worker *worker = state->worker;
+    EditState *edit = &worker->edit;
+    begin_lexer(worker, span, span_end - span_begin, path);
+    worker->lex.line_number = (uint32_t)span_first_line;
+    if (run_procedures(worker) != 0)
+    {
+        reset_edit_state(edit);
+        unmap_file(&mapped);
+        return 1;
+    }
+
+    size_t span_length = span_end - span_begin;
+    bool is_unchanged = (edit->piece_count == 0 && span_length == 0) ||
+        (edit->piece_count == 1 && edit->pieces[0].text == span && edit->pieces[0].length == span_length);
+
+    int result = 0;
+    if (!is_unchanged)
+    {
+        size_t piece_count = edit->piece_count + 2;
+        EditPiece *pieces = (EditPiece *)arena_allocate(&edit->arena, sizeof(EditPiece) * piece_count);
+        pieces[0].text = mapped.data;
+        pieces[0].length = span_begin;
+        memcpy(pieces + 1, edit->pieces, sizeof(EditPiece) * edit->piece_count);
+        pieces[piece_count - 1].text = mapped.data + span_end;
+        pieces[piece_count - 1].length = mapped.size - span_end;
+
+        size_t output_length = 0;
+        for (size_t i = 0; i < piece_count; i++) output_length += pieces[i].length;
+        char *output = (char *)arena_allocate(&edit->arena, output_length + 1);
+        char *write_pos = output;
+        for (size_t i = 0; i < piece_count; i++)
+        {
+            memcpy(write_pos, pieces[i].text, pieces[i].length);
+            write_pos += pieces[i].length;
+        }
+        *write_pos = 0;
+
+        if (write_file_atomic(path, mapped.mode, pieces, piece_count, &file->signature))
+        {
+            update_line_index(index, output, output_length);
+        }
+        else
+        {
+            fprintf(stderr, "Could not write file %s\n", path);
+            result = 1;
+        }
+    }
+
+    reset_edit_state(edit);
+    unmap_file(&mapped);
+    return result;
+}
+
+static void process_pending_files(WatchState *state)
+{
+    for (size_t i = 0; i < state->pending.count; i++)
+    {
+        const char *path = state->pending.paths[i];
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+        bool is_new;
+        WatchedFile *file = find_watched_file(state, path, &is_new);
+        FileSignature current = get_file_signature(&st);
+        if (!is_new && signatures_match(&file->signature, &current)) continue;
+
+        //Only saved files get an index, the first pass doesn't copy every file
+        double begin = get_seconds();
+        int result = is_new ? process_file(state->worker, path, &file->signature, NULL) :
+            process_indexed_file(state, file, path);
+        if (result != 0)
+        {
+            //Don't retry until the file is saved again
+            file->signature = current;
+            continue;
+        }
+
+        if (!signatures_match(&file->signature, &current))
+        {
+            printf("%s (%.2f ms)\n", path, (get_seconds() - begin) * 1000.0);
+            fflush(stdout);
+        }
+    }
+
+    for (size_t i = 0; i < state->pending.count; i++)
+    {
+        free(state->pending.paths[i]);
+    }
+    state->pending.count = 0;
+}
+
+static void handle_watch_events(WatchState *state, const char *root, const char *events, size_t length)
+{
+    char path[4096];
+    size_t offset = 0;
+    while (offset < length)
+    {
+        const struct inotify_event *event = (const struct inotify_event *)(events + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+            //Events were lost, look at everything again
+            watch_directory(state, root);
+            continue;
+        }
+
+        if (event->wd < 0 || (size_t)event->wd >= state->directory_capacity) continue;
+        if (event->mask & IN_IGNORED)
+        {
+            free(state->directories[event->wd]);
+            state->directories[event->wd] = NULL;
+            continue;
+        }
+
+        const char *directory = state->directories[event->wd];
+        if (directory == NULL || event->len == 0) continue;
+
+        //This also skips the temporary files of atomic writes
+        if (event->name[0] == '.') continue;
+        if (!join_directory_path(path, sizeof(path), directory, event->name)) continue;
+
+        if (event->mask & IN_ISDIR)
+        {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            {
+                watch_directory(state, path);
+            }
+        }
+        else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && is_source_file(path))
+        {
+            add_file(&state->pending, path);
+        }
+    }
+}
+
+static int run_watch(const char *root)
+{
+    WatchState state = {};
+    state.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (state.inotify_fd < 0)
+    {
+        fprintf(stderr, "Could not initialize inotify\n");
+        return 1;
+    }
+    state.worker = (Worker *)calloc(1, sizeof(Worker));
+
+    watch_directory(&state, root);
+    if (state.directory_capacity == 0)
+    {
+        return 1;
+    }
+    process_pending_files(&state);
+    printf("Watching %s\n", root);
+    fflush(stdout);
+
+    static char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    double pending_since = 0.0;    //When the oldest of the pending files came in
+    while (true)
+    {
+        int timeout = -1;
+        if (state.pending.count > 0)
+        {
+            double waited_ms = (get_seconds() - pending_since) * 1000.0;
+            if (waited_ms >= WATCH_MAX_DELAY_MS)
+            {
+                process_pending_files(&state);
+                continue;
+            }
+            timeout = WATCH_SETTLE_MS;
+            if (WATCH_MAX_DELAY_MS - waited_ms < timeout) timeout = (int)(WATCH_MAX_DELAY_MS - waited_ms) + 1;
+        }
+
+        struct pollfd poll_fd = {};
+        poll_fd.fd = state.inotify_fd;
+        poll_fd.events = POLLIN;
+        int ready = poll(&poll_fd, 1, timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Could not wait for inotify events\n");
+            return 1;
+        }
+
+        if (ready == 0)
+        {
+            process_pending_files(&state);
+            continue;
+        }
+
+        ssize_t length = read(state.inotify_fd, events, sizeof(events));
+        if (length < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            fprintf(stderr, "Could not read inotify events\n");
+            return 1;
+        }
+        size_t pending_count = state.pending.count;
+        handle_watch_events(&state, root, events, (size_t)length);
+        if (pending_count == 0 && state.pending.count > 0) pending_since = get_seconds();
+    }
+}
+
+static void print_usage()
+{
+    printf("usage: ductus [-j threads] [--stats[=json]] <file | directory | glob | @filelist>...\n");
+    printf("       ductus [--stats[=json]] -    (reads stdin and writes the result to stdout)\n");
+    printf("       ductus --watch <directory>    (reruns a file whenever it is saved)\n");
+    printf("       ductus --undo | --redo        (reverts or reapplies the last run in this directory)\n");
+    printf("       ductus --index <file | directory | glob | @filelist>...    (indexes every identifier)\n");
+    printf("       ductus --find <name>          (lists where an indexed identifier is used)\n");
+    printf("  --script <file> apply the identifier procedures in file to every file as well,\n");
+    printf("                  with an index only the files they can change are run\n");
+    printf("  --diff          write a unified diff of the changes to stdout and leave the files alone,\n");
+    printf("                  exits with 1 when any file would change\n");
+    printf("  --stats         time each phase and count the work done, written to stderr per file\n");
+    printf("  --stats=json    the same as one JSON object per line, followed by a total\n");
+    printf("  --no-journal    rewrite the files without recording the run in %s\n", JOURNAL_DIRECTORY);
+    printf("  --no-cache      run every file, without reading or updating %s\n", SKIP_CACHE_FILENAME);
+    printf("  --no-index      don't narrow a --script run down with %s\n", IDENTIFIER_INDEX_FILENAME);
+    printf("procedures:\n");
+#define ProcedureEntry(token, name, flags, handler, arguments, title, description) \
+    printf("  #%-4s %-20s %s\n", name, arguments, title);
+    ProcedureList
+#undef ProcedureEntry
+}
+
+#ifndef DUCTUS_NO_MAIN
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "You must provide a filename!\n");
+        print_usage();
+        return -1;
+    }
+
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    StatsFormat stats_format = StatsFormat_NONE;
+    bool is_stream = false;
+    bool use_journal = true;
+    bool use_cache = true;
+    bool is_diff = false;
+    const char *script_filename = NULL;
+    bool use_index = true;
+    bool is_index = false;
+    FileList files = {};
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            thread_count = strtol(argv[++i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != 0)
+        {
+            thread_count = strtol(argv[i] + 2, NULL, 10);
+        }
+        else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            print_usage();
+            return 0;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            stats_format = StatsFormat_TEXT;
+        }
+        else if (strcmp(argv[i], "--stats=json") == 0)
+        {
+            stats_format = StatsFormat_JSON;
+        }
+        else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc)
+        {
+            return run_watch(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--undo") == 0 || strcmp(argv[i], "--redo") == 0)
+        {
+            return run_journal_command(strcmp(argv[i], "--redo") == 0);
+        }
+        else if (strcmp(argv[i], "--no-journal") == 0)
+        {
+            use_journal = false;
+        }
+        else if (strcmp(argv[i], "--diff") == 0)
+        {
+            is_diff = true;
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            use_cache = false;
+        }
+        else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc)
+        {
+            script_filename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--index") == 0)
+        {
+            is_index = true;
+        }
+        else if (strcmp(argv[i], "--no-index") == 0)
+        {
+            use_index = false;
+        }
+        else if (strcmp(argv[i], "--find") == 0 && i + 1 < argc)
+        {
+            return run_find_command(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-") == 0)
+        {
+            is_stream = true;
+        }
+        else
+        {
+            collect_argument(&files, argv[i]);
+        }
+    }
+
+    if (is_stream && is_diff)
+    {
+        fprintf(stderr, "--diff works on files, it can't be used with -\n");
+        return 1;
+    }
+    if (is_stream && script_filename != NULL)
+    {
+        fprintf(stderr, "--script works on files, it can't be used with -\n");
+        return 1;
+    }
+
+    if (is_stream)
+    {
+        Worker *worker = (Worker *)calloc(1, sizeof(Worker));
+        RunStats stats;
+        int result = process_stream(worker, STDIN_FILENO, STDOUT_FILENO,
+            stats_format != StatsFormat_NONE ? &stats : NULL);
+        if (result == 0 && stats_format != StatsFormat_NONE)
+        {
+            print_run_stats("<stdin>", &stats, stats_format);
+        }
+        return result;
+    }
+
+    if (files.count == 0)
+    {
+        fprintf(stderr, "No files to process\n");
+        return 1;
+    }
+    if (is_index)
+    {
+        return build_identifier_index(&files, thread_count < 1 ? 1 : (size_t)thread_count);
+    }
+
+    //Compiled before the journal is started so a broken script doesn't leave
+    //an empty run behind
+    ScriptPlan plan;
+    if (script_filename != NULL && !compile_script_plan(script_filename, &plan)) return 1;
+
+    size_t file_count = files.count;
+    IdentifierIndex index;
+    if (script_filename != NULL && use_index && load_identifier_index(&index))
+    {
+        select_indexed_files(&index, &plan, &files);
+        unmap_file(&index.mapped);
+    }
+
+    //Failing to journal is not a reason to not do the work
+    Journal journal;
+    use_journal = use_journal && !is_diff;
+    if (use_journal && !begin_journal(&journal))
+    {
+        fprintf(stderr, "Could not start an undo journal in %s, this run can't be undone\n", JOURNAL_DIRECTORY);
+        use_journal = false;
+    }
+
+    if (thread_count < 1) thread_count = 1;
+    SkipCache skip_cache;
+    if (use_cache) load_skip_cache(&skip_cache);
+
+    size_t pending_count = 0;
+    size_t failed_count = run_worker_pool(&files, (size_t)thread_count, stats_format,
+        use_journal ? &journal : NULL, use_cache ? &skip_cache : NULL,
+        script_filename != NULL ? &plan : NULL, is_diff, &pending_count);
+    if (use_journal) end_journal(&journal);
+    if (use_cache) save_skip_cache(&skip_cache);
+    if (failed_count > 0)
+    {
+        fprintf(stderr, "%zu of %zu files failed\n", failed_count, file_count);
+        return 1;
+    }
+
+    //Like diff(1), so a pre-commit check can fail on it
+    if (pending_count > 0)
+    {
+        fprintf(stderr, "%zu of %zu files would change\n", pending_count, file_count);
+        return 1;
     }
-#endif
 
     //NOTE(Torin) Intentionaly not freeing anything because
     //the operating system is about to do it anyway
     return 0;
 }
+#endif //DUCTUS_NO_MAIN
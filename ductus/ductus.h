@@ -0,0 +1,34 @@
+#ifndef DUCTUS_H
+#define DUCTUS_H
+
+//Build ductus.cpp with DUCTUS_NO_MAIN defined and link against it.  A
+//context keeps its memory between calls and must not be used from two
+//threads at once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DuctusContext ductus_context;
+
+#define DUCTUS_OK 0
+#define DUCTUS_ERROR 1
+
+//The pieces are only valid for the duration of the call
+typedef void ductus_output_proc(void *user_data, const char *text, size_t length);
+
+ductus_context *ductus_create_context(void);
+void ductus_destroy_context(ductus_context *context);
+
+//name only prefixes error messages and may be NULL.  On error nothing is
+//passed to output_proc and the message goes to stderr
+int ductus_process_buffer(ductus_context *context, const char *input, size_t length,
+    ductus_output_proc *output_proc, void *user_data, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //DUCTUS_H
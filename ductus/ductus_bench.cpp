@@ -0,0 +1,374 @@
+//Throughput benchmark for ductus, built on top of ductus.cpp so it measures
+//exactly the code the tool runs
+#define DUCTUS_NO_MAIN
+#include "ductus.cpp"
+
+#include <stdarg.h>
+#include <sys/resource.h>
+
+typedef struct {
+    size_t corpus_size;       //Bytes of source to generate
+    size_t directive_density; //Directives per 1000 generated lines
+    size_t for_line_count;    //Lines in the body of each #fl
+    size_t replace_count;     //#r rules emitted at each replace site
+    size_t nesting_depth;     //Blocks nested inside each function
+    size_t loop_depth;        //#fl loops nested inside each other, 1 is no nesting
+    bool every_procedure;     //Emit #d #dw #ptr #val and member accesses too
+    size_t iteration_count;
+    size_t thread_count;      //Threads the procedure pass splits the corpus across
+    uint32_t seed;
+    const char *output_filename;
+} BenchConfig;
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    size_t line_count;
+    size_t directive_count;
+    size_t directive_budget;
+    uint32_t random_state;
+} Corpus;
+
+//=========================================================
+// Corpus generation
+//=========================================================
+
+static uint32_t next_random(Corpus *corpus)
+{
+    uint32_t x = corpus->random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    corpus->random_state = x;
+    return x;
+}
+
+static void emit(Corpus *corpus, const char *format, ...)
+{
+    va_list args;
+    for (;;)
+    {
+        va_start(args, format);
+        size_t available = corpus->capacity - corpus->length;
+        int written = vsnprintf(corpus->data + corpus->length, available, format, args);
+        va_end(args);
+        if ((size_t)written < available)
+        {
+            corpus->length += written;
+            break;
+        }
+
+        corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 64 * 1024;
+        corpus->data = (char *)realloc(corpus->data, corpus->capacity);
+    }
+}
+
+static void emit_indent(Corpus *corpus, size_t depth)
+{
+    for (size_t i = 0; i < depth; i++) emit(corpus, "    ");
+}
+
+//Accumulates so the density holds at any corpus size
+static bool should_emit_directive(const BenchConfig *config, Corpus *corpus)
+{
+    corpus->directive_budget += config->directive_density;
+    if (corpus->directive_budget < 1000) return false;
+    corpus->directive_budget -= 1000;
+    return true;
+}
+
+//The random numbers are drawn the same way as long as every_procedure is
+//off, so the default corpus stays what it always was
+static void emit_replace_site(const BenchConfig *config, Corpus *corpus, size_t depth)
+{
+    for (size_t i = 0; i < config->replace_count; i++)
+    {
+        uint32_t index = next_random(corpus) % 16;
+        emit_indent(corpus, depth);
+        uint32_t kind = config->every_procedure ? next_random(corpus) % 6 : next_random(corpus) & 1;
+        switch (kind)
+        {
+            case 0: emit(corpus, "#rw count_%u total_%u\n", index, index); break;
+            case 1: emit(corpus, "#r value_%u renamed_%u\n", index, index); break;
+            case 2: emit(corpus, "#d alue_%u\n", index); break;
+            case 3: emit(corpus, "#dw total_%u\n", index); break;
+            case 4: emit(corpus, "#ptr value_%u\n", index); break;
+            case 5: emit(corpus, "#val count_%u\n", index); break;
+        }
+        corpus->line_count++;
+        corpus->directive_count++;
+    }
+}
+
+static void emit_loop_body(const BenchConfig *config, Corpus *corpus, uint32_t kind,
+    size_t depth, size_t loop_depth)
+{
+    emit(corpus, "#fl\n");
+    for (size_t i = 0; i < config->for_line_count; i++)
+    {
+        if (loop_depth > 1 && i == config->for_line_count / 2)
+        {
+            emit_loop_body(config, corpus, kind + 1, depth + 1, loop_depth - 1);
+        }
+        emit_indent(corpus, depth + 1);
+        emit(corpus, "Entry%u_%u value_%u\n", kind, (uint32_t)i, next_random(corpus) % 16);
+    }
+    emit_indent(corpus, loop_depth < config->loop_depth ? depth : 0);
+    if (loop_depth < config->loop_depth)
+    {
+        emit(corpus, "#efl(Inner_#w(0) #w(1))\n");
+    }
+    else
+    {
+        emit(corpus, "#efl(Kind_#w(0) = #w(1),)\n");
+    }
+    corpus->line_count += config->for_line_count + 2;
+    corpus->directive_count++;
+}
+
+static void emit_for_lines(const BenchConfig *config, Corpus *corpus, size_t depth)
+{
+    uint32_t kind = next_random(corpus);
+    emit_indent(corpus, depth);
+    emit(corpus, "enum Kind_%u\n", kind);
+    emit_indent(corpus, depth);
+    emit(corpus, "{\n");
+    emit_loop_body(config, corpus, kind, depth, config->loop_depth);
+    emit_indent(corpus, depth);
+    emit(corpus, "};\n");
+    corpus->line_count += 3;
+}
+
+static void emit_statement(const BenchConfig *config, Corpus *corpus, size_t depth)
+{
+    uint32_t a = next_random(corpus) % 16;
+    uint32_t b = next_random(corpus) % 16;
+    emit_indent(corpus, depth);
+    switch (next_random(corpus) % (config->every_procedure ? 5 : 4))
+    {
+        case 0: emit(corpus, "int value_%u = count_%u * %u;\n", a, b, next_random(corpus) % 1000); break;
+        case 1: emit(corpus, "value_%u += call_function(count_%u, \"text %u\");\n", a, b, a); break;
+        case 2: emit(corpus, "//NOTE comment about value_%u and count_%u\n", a, b); break;
+        case 3: emit(corpus, "if (value_%u > count_%u) value_%u = 0.5f;\n", a, b, a); break;
+        case 4: emit(corpus, "value_%u.next = count_%u->value_%u.total_%u;\n", a, b, a, b); break;
+    }
+    corpus->line_count++;
+}
+
+static void emit_scope(const BenchConfig *config, Corpus *corpus, size_t depth)
+{
+    for (size_t i = 0; i < 8; i++)
+    {
+        if (should_emit_directive(config, corpus))
+        {
+            if (config->for_line_count > 0 && (next_random(corpus) & 1))
+            {
+                emit_for_lines(config, corpus, depth);
+            }
+            else
+            {
+                emit_replace_site(config, corpus, depth);
+            }
+        }
+        else
+        {
+            emit_statement(config, corpus, depth);
+        }
+    }
+
+    if (depth <= config->nesting_depth)
+    {
+        emit_indent(corpus, depth);
+        emit(corpus, "{\n");
+        emit_scope(config, corpus, depth + 1);
+        emit_indent(corpus, depth);
+        emit(corpus, "}\n");
+        corpus->line_count += 2;
+    }
+}
+
+static void generate_corpus(const BenchConfig *config, Corpus *corpus)
+{
+    memset(corpus, 0, sizeof(Corpus));
+    corpus->random_state = config->seed ? config->seed : 1;
+    for (uint32_t function_index = 0; corpus->length < config->corpus_size; function_index++)
+    {
+        emit(corpus, "void function_%u(int value_0)\n{\n", function_index);
+        emit_scope(config, corpus, 1);
+        emit(corpus, "}\n\n");
+        corpus->line_count += 4;
+    }
+
+    //The lexer stops on the terminating null
+    emit(corpus, "");
+}
+
+//=========================================================
+// Measurement
+//=========================================================
+
+//The raw tokenizer never bails out, so this needs no setjmp
+static size_t lex_corpus(Worker *worker, const Corpus *corpus)
+{
+    begin_lexer(worker, corpus->data, corpus->length, "corpus");
+    size_t token_count = 0;
+    Lexer *lex = &worker->lex;
+    do
+    {
+        lex_next_token_and_whitespace(lex);
+        token_count++;
+    } while (lex->token.type != TokenType_END_OF_BUFFER);
+    return token_count;
+}
+
+static size_t count_expansion_bytes(const EditState *edit, const Corpus *corpus)
+{
+    size_t result = 0;
+    for (size_t i = 0; i < edit->piece_count; i++)
+    {
+        const EditPiece *piece = &edit->pieces[i];
+        if (piece->text < corpus->data || piece->text >= corpus->data + corpus->length)
+        {
+            result += piece->length;
+        }
+    }
+    return result;
+}
+
+static void print_bench_usage()
+{
+    printf("usage: ductus_bench [options]\n");
+    printf("  -s <mb>      corpus size in megabytes (default 16)\n");
+    printf("  -d <n>       directives per 1000 lines (default 20)\n");
+    printf("  -f <n>       lines in each #fl body (default 16)\n");
+    printf("  -r <n>       #r rules at each replace site (default 2)\n");
+    printf("  -n <n>       block nesting depth inside functions (default 3)\n");
+    printf("  -l <n>       #fl loops nested inside each other (default 1, no nesting)\n");
+    printf("  -x           also emit #d, #dw, #ptr, #val and member accesses\n");
+    printf("  -i <n>       timed iterations, the fastest is reported (default 10)\n");
+    printf("  -j <n>       threads to split the corpus across (default 1)\n");
+    printf("  -seed <n>    random seed for the generator (default 1)\n");
+    printf("  -o <file>    write the corpus to a file and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig config = {};
+    config.corpus_size = 16 * 1024 * 1024;
+    config.directive_density = 20;
+    config.for_line_count = 16;
+    config.replace_count = 2;
+    config.nesting_depth = 3;
+    config.loop_depth = 1;
+    config.iteration_count = 10;
+    config.thread_count = 1;
+    config.seed = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *option = argv[i];
+        if (strcmp(option, "-h") == 0 || strcmp(option, "--help") == 0)
+        {
+            print_bench_usage();
+            return 0;
+        }
+        if (strcmp(option, "-x") == 0)
+        {
+            config.every_procedure = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "%s needs a value\n", option);
+            print_bench_usage();
+            return 1;
+        }
+
+        const char *value = argv[++i];
+        if (strcmp(option, "-o") == 0) config.output_filename = value;
+        else if (strcmp(option, "-s") == 0) config.corpus_size = (size_t)(atof(value) * 1024 * 1024);
+        else if (strcmp(option, "-d") == 0) config.directive_density = strtoul(value, NULL, 10);
+        else if (strcmp(option, "-f") == 0) config.for_line_count = strtoul(value, NULL, 10);
+        else if (strcmp(option, "-r") == 0) config.replace_count = strtoul(value, NULL, 10);
+        else if (strcmp(option, "-n") == 0) config.nesting_depth = strtoul(value, NULL, 10);
+        else if (strcmp(option, "-l") == 0) config.loop_depth = strtoul(value, NULL, 10);
+        else if (strcmp(option, "-i") == 0) config.iteration_count = strtoul(value, NULL, 10);
+        else if (strcmp(option, "-j") == 0) config.thread_count = strtoul(value, NULL, 10);
+        else if (strcmp(option, "-seed") == 0) config.seed = (uint32_t)strtoul(value, NULL, 10);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", option);
+            print_bench_usage();
+            return 1;
+        }
+    }
+    if (config.iteration_count == 0) config.iteration_count = 1;
+    if (config.loop_depth == 0) config.loop_depth = 1;
+
+    Corpus corpus;
+    generate_corpus(&config, &corpus);
+    if (config.output_filename != NULL)
+    {
+        FILE *file = fopen(config.output_filename, "wb");
+        if (file == NULL || fwrite(corpus.data, 1, corpus.length, file) != corpus.length)
+        {
+            fprintf(stderr, "Could not write file %s\n", config.output_filename);
+            return 1;
+        }
+        fclose(file);
+        return 0;
+    }
+
+    Worker *worker = (Worker *)calloc(1, sizeof(Worker));
+    worker->split_thread_count = config.thread_count;
+    double best_lex_time = 1e30;
+    double best_run_time = 1e30;
+    size_t token_count = 0;
+    size_t expansion_bytes = 0;
+    size_t output_bytes = 0;
+    size_t arena_peak = 0;
+    for (size_t iteration = 0; iteration < config.iteration_count; iteration++)
+    {
+        double lex_begin = get_seconds();
+        token_count = lex_corpus(worker, &corpus);
+        double lex_time = get_seconds() - lex_begin;
+        if (lex_time < best_lex_time) best_lex_time = lex_time;
+
+        double run_begin = get_seconds();
+        begin_lexer(worker, corpus.data, corpus.length, "corpus");
+        if (run_procedures(worker) != 0)
+        {
+            fprintf(stderr, "The generated corpus failed to process\n");
+            return 1;
+        }
+        double run_time = get_seconds() - run_begin;
+        if (run_time < best_run_time) best_run_time = run_time;
+
+        expansion_bytes = count_expansion_bytes(&worker->edit, &corpus);
+        output_bytes = worker->edit.stats.output_bytes;
+        arena_peak = worker->edit.stats.arena_peak;
+        reset_edit_state(&worker->edit);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double megabytes = (double)corpus.length / (1024.0 * 1024.0);
+    printf("corpus      %.2f MB, %zu lines, %zu directives, %zu tokens\n",
+        megabytes, corpus.line_count, corpus.directive_count, token_count);
+    printf("lex         %8.2f ms %10.2f MB/s\n",
+        best_lex_time * 1000.0, megabytes / best_lex_time);
+    printf("procedures  %8.2f ms %10.2f MB/s\n",
+        best_run_time * 1000.0, megabytes / best_run_time);
+    printf("directives  %21.0f /s\n", (double)corpus.directive_count / best_run_time);
+    printf("expansion   %8.2f MB %10.2f MB/s\n",
+        (double)expansion_bytes / (1024.0 * 1024.0),
+        (double)expansion_bytes / (1024.0 * 1024.0) / best_run_time);
+    printf("output      %8.2f MB\n", (double)output_bytes / (1024.0 * 1024.0));
+    printf("arena peak  %8.2f MB\n", (double)arena_peak / (1024.0 * 1024.0));
+    printf("max rss     %8.2f MB\n", (double)usage.ru_maxrss / 1024.0);
+
+    //Not freed, the process is about to exit
+    return 0;
+}
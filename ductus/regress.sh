@@ -0,0 +1,90 @@
+#!/bin/bash
+# Regression check for the procedures.  Generates ductus_bench corpora over
+# a range of seeds and settings, runs each one through a reference ductus
+# and through the ductus.cpp next to this script, and diffs the output of a
+# file run, a stream run (ductus -) and a file run split across threads.
+#
+# usage: regress.sh <reference ductus | git revision> [seed count]
+#
+# The reference is either a ductus binary or a git revision to build one
+# from, e.g. 'regress.sh HEAD' before committing.  The -x and -l corpora use
+# #d #dw #ptr #val and nested #fl, a reference older than those only passes
+# the first three.  CXX picks the compiler, clang++ like build.sh by default.
+# A failing corpus is kept, the path to it is printed.
+
+if [ $# -lt 1 ]; then
+    echo "usage: regress.sh <reference ductus | git revision> [seed count]"
+    exit 1
+fi
+
+CXX=${CXX:-clang++}
+FLAGS="-std=c++14 -pthread -O2 -w"
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+SEED_COUNT=${2:-20}
+PROFILES=(
+    "-s 1"
+    "-s 1 -d 200 -r 6"
+    "-s 2 -d 50 -f 0 -n 8"
+    "-s 2 -d 100 -x"
+    "-s 2 -d 100 -f 6 -l 3 -x"
+)
+
+if [ -f "$1" ] && [ -x "$1" ]; then
+    cp "$1" "$WORK/ductus_reference"
+else
+    mkdir "$WORK/reference"
+    git -C "$DIR" show "$1:./ductus.cpp" > "$WORK/reference/ductus.cpp" || exit 1
+    git -C "$DIR" show "$1:./ductus.h" > "$WORK/reference/ductus.h" 2>/dev/null
+    $CXX $FLAGS "$WORK/reference/ductus.cpp" -o "$WORK/ductus_reference" || exit 1
+fi
+$CXX $FLAGS "$DIR/ductus.cpp" -o "$WORK/ductus" || exit 1
+$CXX $FLAGS "$DIR/ductus_bench.cpp" -o "$WORK/ductus_bench" || exit 1
+
+# Every run starts without a cache or a journal so the procedures really run
+run_file() {
+    rm -rf "$WORK"/.ductus_*
+    cp "$WORK/input.cpp" "$WORK/$2"
+    (cd "$WORK" && ./$1 $3 "$2" > /dev/null 2>&1)
+    echo $? >> "$WORK/$2"
+}
+
+run_stream() {
+    (cd "$WORK" && ./$1 - < input.cpp > "$2" 2> /dev/null)
+    echo $? >> "$WORK/$2"
+}
+
+failure_count=0
+run_count=0
+for profile in "${PROFILES[@]}"; do
+    for seed in $(seq 1 "$SEED_COUNT"); do
+        "$WORK/ductus_bench" $profile -seed "$seed" -o "$WORK/input.cpp" || exit 1
+
+        run_file ductus_reference file_reference.cpp
+        run_file ductus file.cpp
+        run_file ductus split.cpp "-j 4"
+        run_stream ductus_reference stream_reference.out
+        run_stream ductus stream.out
+
+        for mode in file split stream; do
+            case $mode in
+                file) expected=file_reference.cpp; actual=file.cpp ;;
+                split) expected=file_reference.cpp; actual=split.cpp ;;
+                stream) expected=stream_reference.out; actual=stream.out ;;
+            esac
+            run_count=$((run_count + 1))
+            if ! cmp -s "$WORK/$expected" "$WORK/$actual"; then
+                failure_count=$((failure_count + 1))
+                kept="$WORK/failure_$failure_count.cpp"
+                cp "$WORK/input.cpp" "$kept"
+                echo "DIFF $mode: ductus_bench $profile -seed $seed, kept as $kept"
+            fi
+        done
+    done
+done
+
+echo "$failure_count of $run_count runs differ"
+if [ $failure_count -ne 0 ]; then
+    exit 1
+fi
+rm -rf "$WORK"
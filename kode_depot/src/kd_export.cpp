@@ -6,6 +6,8 @@
 #include <vector>
 #include <functional>
 
+#include "kd_platform.h"
+
 struct Identifier {
 	const char* name;
 };
@@ -94,45 +96,6 @@ void debug_init_test_library(Library* library) {
 	library->functions[1] = { "giant_cactus" };
 }
 
-struct GetFilesResult {
-	char filename[256];	
-	uint64_t last_write_time;
-};
-
-#include <Windows.h>
-int get_files_in_directory(const char* directory, char* filename_buffer, char* directory_buffer, uint32_t* file_count, uint32_t* directory_count) {
-	WIN32_FIND_DATA find_data;
-	HANDLE handle = FindFirstFile(directory, &find_data);
-	if (handle == INVALID_HANDLE_VALUE) {
-		printf("Win32ERROR: %", GetLastError());
-		return 1;
-	}
-
-	size_t filename_write_pos = 0;
-	size_t directory_write_pos = 0;
-	do {
-		if (strcmp(find_data.cFileName, ".") == 0) continue;
-		else if (strcmp(find_data.cFileName, "..") == 0) continue;
-
-		if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-			size_t length = strlen(find_data.cFileName);
-			memcpy(&directory_buffer[directory_write_pos], find_data.cFileName, length);
-			directory_buffer[directory_write_pos + length] = 0;
-			directory_write_pos += length + 1;
-			*directory_count += 1;
-		} else {
-			size_t length = strlen(find_data.cFileName);
-			memcpy(&filename_buffer[filename_write_pos], find_data.cFileName, length);
-			filename_buffer[filename_write_pos + length] = 0;
-			filename_write_pos += length + 1;
-			*file_count += 1;
-		}
-
-	} while (FindNextFile(handle, &find_data));
-
-	return 0;
-}
-
 #define KILOBYTES(x) ((x) << 10)
 #define MEGABYTES(x) ((x) << 20)
 #define GIGABYTES(x) ((x) << 30)
@@ -262,14 +225,27 @@ void update_file(const char* filename, uint64_t last_write_time,
 
 }
 
+struct Import_Context {
+	Database* database;
+	Database_Modifications* modifications;
+};
+
+//NOTE(Torin) The walker hands the files over as it finds them, one batch
+//at a time, so importing starts before the whole repository is listed
+static void import_file_records(const File_Record* records, size_t record_count, void* userdata) {
+	Import_Context* context = (Import_Context*)userdata;
+	for (size_t i = 0; i < record_count; i++) {
+		update_file(records[i].path, records[i].last_write_time, context->database, context->modifications);
+		parse_file(records[i].path);
+	}
+}
 
-#include <direct.h>
 int main(int argc, char** argv) {
 	Library library;
 	debug_init_test_library(&library);
 	library.name = "test";
 
-	_mkdir(".internal");
+	platform_create_directory(".internal");
 
 	Database database;
 	database.repository_path = "../repo";
@@ -286,27 +262,12 @@ int main(int argc, char** argv) {
 		&modifications.added_uuid_used_memory, &modifications.added_uuid_memory_capacity);
 
 
-	char filenames[KILOBYTES(10)];
-	char directories[KILOBYTES(10)];
-	uint32_t file_count = 0, directory_count = 0;
-	get_files_in_directory("../repo/*", filenames, directories, &file_count, &directory_count);
-
-	size_t read_pos = 0;
-	char string_buffer[4096];
-	memcpy(string_buffer, SEARCH_DIR, sizeof(SEARCH_DIR));
-	for (uint32_t i = 0; i < file_count; i++) {
-		uint64_t file_hash = make_string_uuid(&filenames[read_pos]);
-		if (!contains_file_hash(&database, file_hash)) {
-			modifications.added_hashes.emplace_back(make_string_uuid(&filenames[read_pos]));
-		} else {
-
-		}
-
-		size_t length = strlen(&filenames[read_pos]);
-		memcpy(string_buffer + sizeof(SEARCH_DIR) - 1, &filenames[read_pos], length);
-		string_buffer[sizeof(SEARCH_DIR) - 1 + length] = 0;
-		read_pos += length + 1;
-		parse_file(string_buffer);
+	Import_Context context;
+	context.database = &database;
+	context.modifications = &modifications;
+	if (platform_walk_directory(database.repository_path, 0, import_file_records, &context) != 0) {
+		printf("Could not open repository %s\n", database.repository_path);
+		return 1;
 	}
 
 	write_database_to_file(&database, &modifications, ".internal/database.kdb");
@@ -0,0 +1,43 @@
+#ifndef KD_PLATFORM_H
+#define KD_PLATFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//NOTE(Torin) One file found by platform_walk_directory.  The path starts
+//with the root the walk was given and is only valid inside the callback.
+//last_write_time is only meant to be compared against an earlier
+//last_write_time of the same file, its units are up to the platform
+typedef struct {
+	const char* path;
+	size_t path_length;
+	uint64_t size;
+	uint64_t last_write_time;
+} File_Record;
+
+//NOTE(Torin) Records are handed over in batches while the walk is still
+//going.  The callback never runs on two threads at once so it can feed
+//the importer directly without any locking of its own
+typedef void File_Record_Callback(const File_Record* records, size_t record_count, void* userdata);
+
+//NOTE(Torin) Walks every directory below root on up to thread_count
+//threads, 0 uses one per processor.  Names starting with a '.' are skipped
+//and links to directories are not followed.  Returns 0 once every file has
+//been handed to the callback, nonzero when root can't be opened
+int platform_walk_directory(const char* root, uint32_t thread_count,
+	File_Record_Callback* callback, void* userdata);
+
+//NOTE(Torin) Returns 0 when the directory exists afterwards
+int platform_create_directory(const char* path);
+
+uint32_t platform_get_processor_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//KD_PLATFORM_H
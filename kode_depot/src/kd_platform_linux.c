@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include "kd_platform.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//Each thread works depth first off the top of its own stack of directories
+//and steals from the bottom of another, where the oldest and usually
+//biggest subtrees are waiting
+
+#define WALK_DIRENT_BUFFER_SIZE (64 << 10)
+#define WALK_RECORD_BATCH_COUNT 512
+#define WALK_PATH_BUFFER_SIZE (64 << 10)
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+typedef struct {
+	int fd;
+	uint32_t reference_count;        //The walk of the directory and each subdirectory not yet opened
+} Walk_Parent;
+
+typedef struct {
+	char* path;                      //Malloced
+	size_t name_offset;              //Of the name within the path, opened relative to the parent
+	Walk_Parent* parent;             //NULL for the root, which is opened by its path
+} Walk_Directory;
+
+typedef struct {
+	Walk_Directory* directories;
+	size_t bottom;                   //Thieves take from here
+	size_t top;                      //The owner pushes and pops here
+	size_t capacity;
+	pthread_mutex_t mutex;
+} Walk_Stack;
+
+typedef struct {
+	Walk_Stack* stacks;
+	uint32_t thread_count;
+	size_t pending_count;            //Directories pushed and not yet walked
+	size_t queued_count;             //Directories sitting in a stack, changed under its mutex
+	uint32_t waiting_count;          //Threads asleep on idle_condition
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_condition;
+	pthread_mutex_t callback_mutex;
+	File_Record_Callback* callback;
+	void* userdata;
+} Walk_State;
+
+typedef struct {
+	Walk_State* state;
+	uint32_t index;
+	pthread_t thread;
+	int is_running;
+	File_Record records[WALK_RECORD_BATCH_COUNT];
+	size_t record_count;
+	char paths[WALK_PATH_BUFFER_SIZE];
+	size_t paths_used;
+	char dirents[WALK_DIRENT_BUFFER_SIZE];
+} Walk_Thread;
+
+static void release_parent(Walk_Parent* parent) {
+	if (parent == NULL) return;
+	if (__atomic_sub_fetch(&parent->reference_count, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(parent->fd);
+		free(parent);
+	}
+}
+
+//Counted before it is pushed, so the count can't drop to zero
+//while the directory it came from is still being walked.  A sleeping thread
+//counts itself in waiting_count before it looks at queued_count and this
+//looks at waiting_count after it bumps queued_count, so either the thread
+//sees the directory or it gets woken up
+static void push_directory(Walk_State* state, uint32_t index, const Walk_Directory* directory) {
+	__atomic_fetch_add(&state->pending_count, 1, __ATOMIC_RELAXED);
+	Walk_Stack* stack = &state->stacks[index];
+	pthread_mutex_lock(&stack->mutex);
+	if (stack->bottom == stack->top) {
+		stack->bottom = 0;
+		stack->top = 0;
+	}
+	if (stack->top == stack->capacity) {
+		stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+		stack->directories = (Walk_Directory*)realloc(stack->directories, sizeof(Walk_Directory) * stack->capacity);
+	}
+	stack->directories[stack->top++] = *directory;
+	__atomic_add_fetch(&state->queued_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&stack->mutex);
+
+	if (__atomic_load_n(&state->waiting_count, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&state->idle_mutex);
+		pthread_cond_signal(&state->idle_condition);
+		pthread_mutex_unlock(&state->idle_mutex);
+	}
+}
+
+static int pop_directory(Walk_State* state, uint32_t index, Walk_Directory* result) {
+	Walk_Stack* stack = &state->stacks[index];
+	int found = 0;
+	pthread_mutex_lock(&stack->mutex);
+	if (stack->top > stack->bottom) {
+		*result = stack->directories[--stack->top];
+		__atomic_sub_fetch(&state->queued_count, 1, __ATOMIC_SEQ_CST);
+		found = 1;
+	}
+	pthread_mutex_unlock(&stack->mutex);
+	return found;
+}
+
+static int steal_directory(Walk_State* state, uint32_t thief, Walk_Directory* result) {
+	for (uint32_t i = 1; i < state->thread_count; i++) {
+		Walk_Stack* stack = &state->stacks[(thief + i) % state->thread_count];
+		int found = 0;
+		pthread_mutex_lock(&stack->mutex);
+		if (stack->top > stack->bottom) {
+			*result = stack->directories[stack->bottom++];
+			__atomic_sub_fetch(&state->queued_count, 1, __ATOMIC_SEQ_CST);
+			found = 1;
+		}
+		pthread_mutex_unlock(&stack->mutex);
+		if (found) return 1;
+	}
+	return 0;
+}
+
+static void flush_records(Walk_Thread* thread) {
+	if (thread->record_count == 0) return;
+	Walk_State* state = thread->state;
+	pthread_mutex_lock(&state->callback_mutex);
+	state->callback(thread->records, thread->record_count, state->userdata);
+	pthread_mutex_unlock(&state->callback_mutex);
+	thread->record_count = 0;
+	thread->paths_used = 0;
+}
+
+static char* join_path(const char* directory, size_t directory_length, const char* name, size_t name_length) {
+	int has_separator = directory_length > 0 && directory[directory_length - 1] == '/';
+	size_t length = directory_length + !has_separator + name_length;
+	if (length >= PATH_MAX) return NULL;
+
+	char* result = (char*)malloc(length + 1);
+	memcpy(result, directory, directory_length);
+	if (!has_separator) result[directory_length] = '/';
+	memcpy(result + length - name_length, name, name_length);
+	result[length] = 0;
+	return result;
+}
+
+static void add_record(Walk_Thread* thread, const char* directory, size_t directory_length,
+	const char* name, size_t name_length, const struct stat* st)
+{
+	int has_separator = directory_length > 0 && directory[directory_length - 1] == '/';
+	size_t length = directory_length + !has_separator + name_length;
+	if (thread->record_count == WALK_RECORD_BATCH_COUNT ||
+		thread->paths_used + length + 1 > WALK_PATH_BUFFER_SIZE)
+	{
+		flush_records(thread);
+	}
+
+	char* path = thread->paths + thread->paths_used;
+	memcpy(path, directory, directory_length);
+	if (!has_separator) path[directory_length] = '/';
+	memcpy(path + length - name_length, name, name_length);
+	path[length] = 0;
+	thread->paths_used += length + 1;
+
+	File_Record* record = &thread->records[thread->record_count++];
+	record->path = path;
+	record->path_length = length;
+	record->size = (uint64_t)st->st_size;
+	record->last_write_time = (uint64_t)st->st_mtim.tv_sec * 1000000000ull + (uint64_t)st->st_mtim.tv_nsec;
+}
+
+//O_NOFOLLOW keeps a directory that was swapped for a link
+//after it was listed from taking the walk somewhere else
+static void walk_directory(Walk_Thread* thread, const Walk_Directory* walk) {
+	const char* directory = walk->path;
+	int fd;
+	if (walk->parent != NULL) {
+		fd = openat(walk->parent->fd, directory + walk->name_offset,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	} else {
+		fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	int open_error = errno;
+	release_parent(walk->parent);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open directory %s: %s\n", directory, strerror(open_error));
+		return;
+	}
+
+	Walk_Parent* parent = (Walk_Parent*)malloc(sizeof(Walk_Parent));
+	parent->fd = fd;
+	parent->reference_count = 1;
+	size_t directory_length = strlen(directory);
+	for (;;) {
+		long read_size = syscall(SYS_getdents64, fd, thread->dirents, WALK_DIRENT_BUFFER_SIZE);
+		if (read_size <= 0) break;
+
+		for (long offset = 0; offset < read_size;) {
+			struct linux_dirent64* entry = (struct linux_dirent64*)(thread->dirents + offset);
+			offset += entry->d_reclen;
+			if (entry->d_name[0] == '.') continue;
+
+			//Links are never followed to directories so the walk can't loop.  Some
+			//filesystems don't fill in d_type at all
+			struct stat st;
+			unsigned char type = entry->d_type;
+			if (type == DT_UNKNOWN || type == DT_LNK) {
+				int flags = type == DT_UNKNOWN ? AT_SYMLINK_NOFOLLOW : 0;
+				if (fstatat(fd, entry->d_name, &st, flags) != 0) continue;
+				if (S_ISREG(st.st_mode)) type = DT_REG;
+				else if (S_ISDIR(st.st_mode) && entry->d_type == DT_UNKNOWN) type = DT_DIR;
+				else continue;
+			} else if (type == DT_REG) {
+				if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+			}
+
+			size_t name_length = strlen(entry->d_name);
+			if (type == DT_DIR) {
+				char* path = join_path(directory, directory_length, entry->d_name, name_length);
+				if (path == NULL) {
+					fprintf(stderr, "Path too long in %s\n", directory);
+					continue;
+				}
+				Walk_Directory subdirectory;
+				subdirectory.path = path;
+				subdirectory.name_offset = strlen(path) - name_length;
+				subdirectory.parent = parent;
+				__atomic_add_fetch(&parent->reference_count, 1, __ATOMIC_RELAXED);
+				push_directory(thread->state, thread->index, &subdirectory);
+			} else if (type == DT_REG) {
+				if (directory_length + name_length + 2 > WALK_PATH_BUFFER_SIZE) continue;
+				add_record(thread, directory, directory_length, entry->d_name, name_length, &st);
+			}
+		}
+	}
+	release_parent(parent);
+}
+
+static void* walk_thread_proc(void* userdata) {
+	Walk_Thread* thread = (Walk_Thread*)userdata;
+	Walk_State* state = thread->state;
+	for (;;) {
+		Walk_Directory directory;
+		if (pop_directory(state, thread->index, &directory) ||
+			steal_directory(state, thread->index, &directory))
+		{
+			walk_directory(thread, &directory);
+			free(directory.path);
+			if (__atomic_sub_fetch(&state->pending_count, 1, __ATOMIC_ACQ_REL) == 0) {
+				pthread_mutex_lock(&state->idle_mutex);
+				pthread_cond_broadcast(&state->idle_condition);
+				pthread_mutex_unlock(&state->idle_mutex);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&state->idle_mutex);
+		__atomic_add_fetch(&state->waiting_count, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&state->queued_count, __ATOMIC_SEQ_CST) == 0 &&
+			__atomic_load_n(&state->pending_count, __ATOMIC_SEQ_CST) != 0)
+		{
+			pthread_cond_wait(&state->idle_condition, &state->idle_mutex);
+		}
+		__atomic_sub_fetch(&state->waiting_count, 1, __ATOMIC_SEQ_CST);
+		int is_done = __atomic_load_n(&state->pending_count, __ATOMIC_ACQUIRE) == 0;
+		pthread_mutex_unlock(&state->idle_mutex);
+		if (is_done) break;
+	}
+	flush_records(thread);
+	return NULL;
+}
+
+int platform_walk_directory(const char* root, uint32_t thread_count,
+	File_Record_Callback* callback, void* userdata)
+{
+	struct stat st;
+	if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) return 1;
+	if (thread_count == 0) thread_count = platform_get_processor_count();
+
+	Walk_State state;
+	memset(&state, 0, sizeof(Walk_State));
+	state.thread_count = thread_count;
+	state.callback = callback;
+	state.userdata = userdata;
+	state.stacks = (Walk_Stack*)calloc(thread_count, sizeof(Walk_Stack));
+	pthread_mutex_init(&state.idle_mutex, NULL);
+	pthread_cond_init(&state.idle_condition, NULL);
+	pthread_mutex_init(&state.callback_mutex, NULL);
+	for (uint32_t i = 0; i < thread_count; i++) {
+		pthread_mutex_init(&state.stacks[i].mutex, NULL);
+	}
+
+	//A thread that couldn't be started leaves its stack empty and the others do its share
+	Walk_Thread* threads = (Walk_Thread*)calloc(thread_count, sizeof(Walk_Thread));
+	Walk_Directory directory;
+	directory.path = strdup(root);
+	directory.name_offset = 0;
+	directory.parent = NULL;
+	push_directory(&state, 0, &directory);
+	for (uint32_t i = 0; i < thread_count; i++) {
+		threads[i].state = &state;
+		threads[i].index = i;
+		if (i > 0) {
+			int error = pthread_create(&threads[i].thread, NULL, walk_thread_proc, &threads[i]);
+			threads[i].is_running = error == 0;
+			if (error != 0) fprintf(stderr, "Could not start a walk thread: %s\n", strerror(error));
+		}
+	}
+	walk_thread_proc(&threads[0]);
+	for (uint32_t i = 1; i < thread_count; i++) {
+		if (threads[i].is_running) pthread_join(threads[i].thread, NULL);
+	}
+
+	for (uint32_t i = 0; i < thread_count; i++) {
+		pthread_mutex_destroy(&state.stacks[i].mutex);
+		free(state.stacks[i].directories);
+	}
+	pthread_cond_destroy(&state.idle_condition);
+	pthread_mutex_destroy(&state.idle_mutex);
+	pthread_mutex_destroy(&state.callback_mutex);
+	free(state.stacks);
+	free(threads);
+	return 0;
+}
+
+int platform_create_directory(const char* path) {
+	if (mkdir(path, 0755) == 0 || errno == EEXIST) return 0;
+	return 1;
+}
+
+uint32_t platform_get_processor_count(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (uint32_t)count : 1;
+}
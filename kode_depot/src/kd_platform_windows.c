@@ -0,0 +1,68 @@
+#include "kd_platform.h"
+
+#include <direct.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <Windows.h>
+
+//NOTE(Torin) Still single threaded, thread_count is ignored.  Every file
+//goes to the callback on its own as it is found
+
+static void walk_directory(const char* directory, File_Record_Callback* callback, void* userdata) {
+	char search_path[MAX_PATH];
+	int search_length = snprintf(search_path, sizeof(search_path), "%s\\*", directory);
+	if (search_length < 0 || search_length >= (int)sizeof(search_path)) return;
+
+	WIN32_FIND_DATAA find_data;
+	HANDLE handle = FindFirstFileA(search_path, &find_data);
+	if (handle == INVALID_HANDLE_VALUE) {
+		printf("Win32ERROR: %lu\n", GetLastError());
+		return;
+	}
+
+	do {
+		if (find_data.cFileName[0] == '.') continue;
+
+		char path[MAX_PATH];
+		int length = snprintf(path, sizeof(path), "%s\\%s", directory, find_data.cFileName);
+		if (length < 0 || length >= (int)sizeof(path)) continue;
+
+		if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+				walk_directory(path, callback, userdata);
+			}
+		} else {
+			File_Record record;
+			record.path = path;
+			record.path_length = (size_t)length;
+			record.size = ((uint64_t)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+			record.last_write_time = ((uint64_t)find_data.ftLastWriteTime.dwHighDateTime << 32) |
+				find_data.ftLastWriteTime.dwLowDateTime;
+			callback(&record, 1, userdata);
+		}
+	} while (FindNextFileA(handle, &find_data));
+
+	FindClose(handle);
+}
+
+int platform_walk_directory(const char* root, uint32_t thread_count,
+	File_Record_Callback* callback, void* userdata)
+{
+	(void)thread_count;
+	DWORD attributes = GetFileAttributesA(root);
+	if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) return 1;
+	walk_directory(root, callback, userdata);
+	return 0;
+}
+
+int platform_create_directory(const char* path) {
+	if (_mkdir(path) == 0 || errno == EEXIST) return 0;
+	return 1;
+}
+
+uint32_t platform_get_processor_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}